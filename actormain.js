@@ -9,6 +9,14 @@
     let schedule_timer = globs.schedule_timer;
     let socket_connect = globs.socket_connect;
     let socket_close = globs.socket_close;
+    let socket_cancel = globs.socket_cancel;
+    let cache_lookup = globs.cache_lookup;
+    let cache_store = globs.cache_store;
+    let cache_abandon = globs.cache_abandon;
+    let html_tokenize = globs.html_tokenize;
+    let spawn = globs.spawn;
+    let _parent = globs.parent;
+    let _actor_id = globs.actor_id;
 
     let _mailbox = [];
     let _gen_stack = [];
@@ -22,8 +30,30 @@
     let _connects = [];
     let _xhrs = {};
     let _xhrid = 1;
+    // XMLHttpRequest socket deadlines in milliseconds: to connect, to send
+    // each chunk of the request, for the first byte of the response, and
+    // between later reads.
+    let _CONNECT_TIMEOUT = 10000;
+    let _SEND_TIMEOUT = 30000;
+    let _FIRST_BYTE_TIMEOUT = 30000;
+    let _IDLE_TIMEOUT = 15000;
+    let _pools = [];
+    // A pool stops replacing workers after this many in a row exit
+    // without finishing a job, e.g. when the script throws at startup.
+    let _POOL_MAX_FAILURES = 3;
 
     function cast(pattern, message) {
+        // Pool workers' answers and exits are handled by their pool.
+        if ((pattern === "done" || pattern === "exit") && _pool_event(pattern, message)) {
+            return;
+        }
+        if (pattern === "error" && message[0] === null && message[2] === undefined) {
+            // The timer behind wait() was refused; wake it rather than
+            // leave it waiting for ever.
+            _err("wait: " + message[1]);
+            pattern = "wait";
+            message = undefined;
+        }
         _mailbox.push([pattern, message]);
     }
 
@@ -244,6 +274,7 @@
                 port = 80;
             } else if (parts.scheme === 'https') {
                 port = 443;
+                this._secure = true;
             } else {
                 throw new Error("Unsupported scheme: " + parts.scheme);
             }
@@ -255,38 +286,97 @@
             }
             this._sock = new Socket(host, port);
             _xhrs[this._id] = this;
-            this._fd = socket_connect(host, port, this._id);
             this._host = host;
+            this._port = port;
             this._method = method;
             this._url = parts.url;
+            if (parts.query) {
+                this._url += '?' + parts.query;
+            }
             this._user = user;
             this._pw = pw;
+            this._cached = false;
+            this._cacheKey = null;
+            // The cache is consulted in send, once the request headers a
+            // response may Vary on are known.
+            this._lookupKey = null;
+            if (method === "GET") {
+                this._lookupKey = parts.scheme + '://' + host + ':' + port + this._url;
+            }
             this.readyState = XMLHttpRequest.prototype.OPENED;
         },
+        // The request is written once the 'connect' message arrives.
+        _fetch: function _fetch() {
+            this._connected = false;
+            this._fd = socket_connect(
+                this._host, this._port, this._id, _CONNECT_TIMEOUT, !!this._secure);
+        },
         setRequestHeader: function setRequestHeader(header, value) {
             this._headers.push([header, value]);
         },
         send: function send(data) {
+            this._data = data;
+            if (this._lookupKey) {
+                let key = this._lookupKey;
+                this._lookupKey = null;
+                this._cacheHeaders = _header_lines(this._headers);
+                let lookup = cache_lookup(key, this._cacheHeaders, this._id);
+                if (lookup[0] === "hit" || lookup[0] === "wait") {
+                    // The response will arrive as a 'cache' message.
+                    this._cached = true;
+                } else {
+                    // We are fetching for everyone, and must cache_store the result.
+                    this._cacheKey = key;
+                    this._validated = !!(lookup[1] || lookup[2]);
+                    if (lookup[1]) {
+                        this._headers.push(["If-None-Match", lookup[1]]);
+                    }
+                    if (lookup[2]) {
+                        this._headers.push(["If-Modified-Since", lookup[2]]);
+                    }
+                }
+            }
             this._request = this._method + ' ' + this._url + ' HTTP/1.0\r\n';
             this._request += 'Host: ' + this._host + '\r\n';
             if (data) {
                 this._request += 'Content-Length: ' + data.length + '\r\n';
             }
-            for (let i = 0; i < this._headers.length; i++) {
-                let key = this._headers[i][0];
-                let val = this._headers[i][1];
-                this._request += key + ': ' + val + '\r\n';
-            }
+            this._request += _header_lines(this._headers);
             this._request += '\r\n';
             if (data) {
                 this._request += data;
             }
-            if (this.readyState === XMLHttpRequest.prototype.OPENED) {
-                schedule_write(this._fd, this._request, this._id);
+            if (this._cached) {
+                // Kept in case the response we wait for cannot be shared.
+                return;
+            }
+            if (this._fd === undefined) {
+                this._fetch();
+            } else if (this._connected) {
+                schedule_write(this._fd, this._request, this._id, _SEND_TIMEOUT);
             }
         },
         abort: function abort() {
-        
+            if (!_xhrs[this._id]) {
+                return;
+            }
+            delete _xhrs[this._id];
+            if (this._fd !== undefined) {
+                // Anything still outstanding on the socket is dropped.
+                socket_cancel(this._fd, this._id);
+                this._fd = undefined;
+            }
+            if (this._cacheKey) {
+                cache_abandon(this._cacheKey);
+                this._cacheKey = null;
+            }
+            this.status = 0;
+            this.readyState = XMLHttpRequest.prototype.DONE;
+            this.onreadystatechange.apply(this);
+            this.readyState = XMLHttpRequest.prototype.UNSENT;
+            if (this.onabort) {
+                this.onabort.apply(this);
+            }
         },
         getResponseHeader: function getResponseHeader(header) {
         
@@ -296,8 +386,302 @@
         }
     }
 
+    // A fixed set of warm actors running the same script. Messages passed
+    // to submit are cast to an idle worker as 'job'; the worker answers
+    // with done(result), which is passed to pool.ondone(result, message),
+    // and is then reused. A job whose worker exits before answering is
+    // passed to pool.onerror(message, reason). Workers that exit are
+    // replaced until the pool is closed, or until _POOL_MAX_FAILURES in a
+    // row exit without finishing a job, after which the jobs still queued
+    // fail too. Workers are spawned with the given priority and quotas,
+    // or ours.
+    function Pool(filename, size, priority, quotas) {
+        this._filename = filename;
+        this._priority = priority;
+        this._quotas = quotas;
+        this._workers = {};
+        this._jobs = {};
+        this._idle = [];
+        this._queue = [];
+        this._pending = 0;
+        this._failures = 0;
+        this._closed = false;
+        this.ondone = null;
+        this.onerror = null;
+        for (let i = 0; i < size; i++) {
+            this._start();
+        }
+        _pools.push(this);
+    }
+    Pool.prototype = {
+        toString: function() { return "[object Pool('" + this._filename + "')]"; },
+        submit: function submit(message) {
+            if (this._closed) {
+                throw new Error("Pool is closed");
+            }
+            this._pending++;
+            if (this._idle.length) {
+                this._send(this._idle.shift(), message);
+            } else if (Object.keys(this._workers).length) {
+                this._queue.push(message);
+            } else {
+                this._fail(message, "no workers");
+            }
+        },
+        close: function close() {
+            this._closed = true;
+            this._queue = [];
+            for (let id in this._workers) {
+                this._workers[id]("stop", "");
+            }
+        },
+        _start: function _start() {
+            let address = spawn(this._filename, this._priority, undefined, this._quotas);
+            this._workers[address.id] = address;
+            this._ready(address.id);
+        },
+        _send: function _send(id, message) {
+            this._jobs[id] = message;
+            this._workers[id]("job", message);
+        },
+        _ready: function _ready(id) {
+            if (this._queue.length) {
+                this._send(id, this._queue.shift());
+            } else {
+                this._idle.push(id);
+            }
+        },
+        _done: function _done(id, result) {
+            let message = this._jobs[id];
+            delete this._jobs[id];
+            this._pending--;
+            this._failures = 0;
+            this._ready(id);
+            if (this.ondone) {
+                this._call(this.ondone, [result, message]);
+            }
+        },
+        _exit: function _exit(id, reason) {
+            delete this._workers[id];
+            let i = this._idle.indexOf(id);
+            if (i >= 0) {
+                this._idle.splice(i, 1);
+            }
+            if (this._closed) {
+                return;
+            }
+            if (id in this._jobs) {
+                // It died in the middle of a job.
+                let message = this._jobs[id];
+                delete this._jobs[id];
+                this._fail(message, reason);
+            }
+            if (++this._failures < _POOL_MAX_FAILURES) {
+                this._start();
+            } else if (!Object.keys(this._workers).length) {
+                _err("Pool " + this._filename + " gave up: " + reason);
+                let queue = this._queue;
+                this._queue = [];
+                for (let j = 0; j < queue.length; j++) {
+                    this._fail(queue[j], reason);
+                }
+            }
+        },
+        _fail: function _fail(message, reason) {
+            this._pending--;
+            if (this.onerror) {
+                this._call(this.onerror, [message, reason]);
+            } else {
+                _err("Pool job lost: " + reason);
+            }
+        },
+        _call: function _call(func, args) {
+            try {
+                func.apply(this, args);
+            } catch (e) {
+                _err("Exception in pool callback:");
+                _err(e);
+                _err(e.stack);
+            }
+        }
+    }
+
+    // Returns true if the message came from a pool's worker.
+    function _pool_event(pattern, message) {
+        let parsed = pattern === "exit" ? message : JSON.parse(message);
+        let id = parsed[0];
+        for (let i = 0; i < _pools.length; i++) {
+            if (_pools[i]._workers[id]) {
+                if (pattern === "exit") {
+                    _pools[i]._exit(id, parsed[1]);
+                } else {
+                    _pools[i]._done(id, parsed[1]);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    function _pools_busy() {
+        for (let i = 0; i < _pools.length; i++) {
+            if (_pools[i]._pending) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Answer the job this pool worker is handling.
+    function done(result) {
+        _parent("done", JSON.stringify([_actor_id, result]));
+    }
+
+    // Main loop for pool workers: yield serve(handler). The handler gets
+    // each job message and returns the result, or a generator which
+    // finishes with yield result(value).
+    function serve(handler) {
+        while (true) {
+            let next = yield receive();
+            if (next[0] === "stop") {
+                return;
+            } else if (next[0] === "job") {
+                let r = handler(next[1]);
+                if (r && r.next) {
+                    r = yield r;
+                }
+                done(r);
+            }
+        }
+    }
+
+    function _parse_headers(xhr) {
+        if (!xhr.statusText) {
+            let i = xhr._response.indexOf("\r\n\r\n");
+            if (i > 0) {
+                xhr._bodyIndex = i + 4;
+                let j = xhr._response.indexOf("\r\n");
+                let parts = xhr._response.substring(0, j).split(' ');
+                xhr.status = parseInt(parts[1]);
+                for (let q = 1; q < parts.length; q++) {
+                    xhr.statusText += parts[q] + " ";
+                }
+                xhr.statusText = xhr.statusText.substring(0, xhr.statusText.length - 1);
+                let headers = xhr._response.substring(j + 2, i);
+                while (headers) {
+                    let k = headers.indexOf("\r\n");
+                    let header = "";
+                    if (k > 0) {
+                        header = headers.substring(0, k);
+                        headers = headers.substring(k + 2);
+                    } else {
+                        header = headers;
+                        headers = "";
+                    }
+                    let l = header.indexOf(": ");
+                    let key = header.substring(0, l);
+                    let val = header.substring(l + 2);
+                    if (key.toLowerCase() === "content-length") {
+                        xhr._contentLength = parseInt(val);
+                    }
+                    xhr._responseHeaders.push([key, val]);
+                }
+                xhr.readyState = XMLHttpRequest.prototype.HEADERS_RECEIVED;
+                xhr.onreadystatechange.apply(xhr);
+            }
+        }
+    }
+
+    // "Name: value" lines for [name, value] pairs.
+    function _header_lines(headers) {
+        let lines = "";
+        for (let i = 0; i < headers.length; i++) {
+            lines += headers[i][0] + ': ' + headers[i][1] + '\r\n';
+        }
+        return lines;
+    }
+
+    // The whole response is in xhr._response.
+    function _complete(xhr) {
+        if (xhr._bodyIndex !== undefined && xhr._contentLength === undefined) {
+            xhr._contentLength = xhr._response.length - xhr._bodyIndex;
+        }
+        if (xhr._cacheKey) {
+            let response = cache_store(xhr._cacheKey, xhr._cacheHeaders, xhr._response);
+            if (response === null && xhr._validated) {
+                // The copy we revalidated has been evicted meanwhile.
+                return _refetch(xhr);
+            } else if (response === null) {
+                cache_abandon(xhr._cacheKey);
+                response = xhr._response;
+            }
+            xhr._cacheKey = null;
+            if (xhr.status === 304 && response !== xhr._response) {
+                // Revalidated, so answer with the cached copy.
+                xhr.status = 0;
+                xhr.statusText = "";
+                xhr._responseHeaders = [];
+                xhr._contentLength = undefined;
+                xhr._response = response;
+                _parse_headers(xhr);
+                return _complete(xhr);
+            }
+        }
+        if (xhr._fd !== undefined) {
+            socket_close(xhr._fd);
+            xhr._fd = undefined;
+        }
+        xhr.responseText = xhr._response.substring(xhr._bodyIndex);
+        xhr.readyState = XMLHttpRequest.prototype.DONE;
+        xhr.onreadystatechange.apply(xhr);
+        delete _xhrs[xhr._id];
+    }
+
+    // Fetch the url again without validators, still as the cache leader.
+    function _refetch(xhr) {
+        if (xhr._fd !== undefined) {
+            socket_close(xhr._fd);
+            xhr._fd = undefined;
+        }
+        xhr._validated = false;
+        xhr._headers = xhr._headers.filter(function(header) {
+            return header[0] !== "If-None-Match" && header[0] !== "If-Modified-Since";
+        });
+        xhr.status = 0;
+        xhr.statusText = "";
+        xhr._responseHeaders = [];
+        xhr._contentLength = undefined;
+        xhr._bodyIndex = undefined;
+        xhr._response = "";
+        xhr._fetch();
+        xhr.send(xhr._data);
+    }
+
+    // The request failed or timed out; reason is the 'error' message's.
+    function _fail(xhr, reason) {
+        delete _xhrs[xhr._id];
+        if (xhr._fd !== undefined) {
+            socket_close(xhr._fd);
+            xhr._fd = undefined;
+        }
+        if (xhr._cacheKey) {
+            // Let anyone waiting on our response fetch it themselves.
+            cache_abandon(xhr._cacheKey);
+            xhr._cacheKey = null;
+        }
+        xhr.status = 0;
+        xhr._error = reason;
+        xhr.readyState = XMLHttpRequest.prototype.DONE;
+        xhr.onreadystatechange.apply(xhr);
+        if (reason === "timeout" && xhr.ontimeout) {
+            xhr.ontimeout.apply(xhr);
+        } else if (xhr.onerror) {
+            xhr.onerror.apply(xhr);
+        }
+    }
+
     function _drain() {
-        while (Object.keys(_timeouts).length || Object.keys(_xhrs).length) {
+        while (Object.keys(_timeouts).length || Object.keys(_xhrs).length || _pools_busy()) {
             let next = yield receive();
             let pattern = next[0];
             let data = next[1];
@@ -313,24 +697,36 @@
                     _err(e.stack);
                 }
             } else if (pattern === "connect") {
+                // Requests that were aborted meanwhile are ignored, here
+                // and below.
                 let fd = data[0];
                 let xhr = _xhrs[data[1]];
+                if (!xhr) {
+                    continue;
+                }
                 xhr._fd = fd;
+                xhr._connected = true;
                 xhr.readyState = XMLHttpRequest.prototype.OPENED;
                 xhr.onreadystatechange.apply(xhr);
                 if (xhr._request) {
-                    schedule_write(fd, xhr._request, xhr._id);
+                    schedule_write(fd, xhr._request, xhr._id, _SEND_TIMEOUT);
                 }
             } else if (pattern === "send") {
                 let xhr = _xhrs[data[2]];
+                if (!xhr) {
+                    continue;
+                }
                 xhr._request = xhr._request.substring(data[1]);
                 if (xhr._request.length) {
-                    schedule_write(xhr._fd, xhr._request, xhr._id);
+                    schedule_write(xhr._fd, xhr._request, xhr._id, _SEND_TIMEOUT);
                 } else {
-                    schedule_read(xhr._fd, 32768, xhr._id);
+                    schedule_read(xhr._fd, 32768, xhr._id, _FIRST_BYTE_TIMEOUT);
                 }
             } else if (pattern === "recv") {
                 let xhr = _xhrs[data[2]];
+                if (!xhr) {
+                    continue;
+                }
                 if (data[1].length) {
                     xhr._response += data[1];
                 } else {
@@ -339,66 +735,107 @@
                         xhr._contentLength = xhr._response.length - xhr._bodyIndex;
                     }
                 }
-                if (!xhr.statusText) {
-                    let i = xhr._response.indexOf("\r\n\r\n");
-                    if (i > 0) {
-                        xhr._bodyIndex = i + 4;
-                        let j = xhr._response.indexOf("\r\n");
-                        let parts = xhr._response.substring(0, j).split(' ');
-                        xhr.status = parseInt(parts[1]);
-                        for (let q = 1; q < parts.length; q++) {
-                            xhr.statusText += parts[q] + " ";
-                        }
-                        xhr.statusText = xhr.statusText.substring(0, xhr.statusText.length - 1);
-                        let headers = xhr._response.substring(j + 2, i);
-                        while (headers) {
-                            let k = headers.indexOf("\r\n");
-                            let header = "";
-                            if (k > 0) {
-                                header = headers.substring(0, k);
-                                headers = headers.substring(k + 2);
-                            } else {
-                                header = headers;
-                                headers = "";
-                            }
-                            let l = header.indexOf(": ");
-                            let key = header.substring(0, l);
-                            let val = header.substring(l + 2);
-                            if (key.toLowerCase() === "content-length") {
-                                xhr._contentLength = parseInt(val);
-                            }
-                            xhr._responseHeaders.push([key, val]);
-                        }
-                        xhr.readyState = XMLHttpRequest.prototype.HEADERS_RECEIVED;
-                        xhr.onreadystatechange.apply(xhr);
-                    }
-                }
+                _parse_headers(xhr);
                 if (xhr._bodyIndex + xhr._contentLength === xhr._response.length) {
-                    xhr.responseText = xhr._response.substring(xhr._bodyIndex);
-                    xhr.readyState = XMLHttpRequest.prototype.DONE;
-                    xhr.onreadystatechange.apply(xhr);
-                    delete _xhrs[xhr._id];
+                    _complete(xhr);
                 } else {
-                    schedule_read(xhr._fd, 32768, xhr._id);
+                    schedule_read(xhr._fd, 32768, xhr._id, _IDLE_TIMEOUT);
                     xhr.readyState = XMLHttpRequest.prototype.LOADING;
                     xhr.onreadystatechange.apply(xhr);
                 }
+            } else if (pattern === "cache") {
+                let xhr = _xhrs[data[0]];
+                if (!xhr) {
+                    continue;
+                }
+                if (data[1].length) {
+                    xhr._response = data[1];
+                    _parse_headers(xhr);
+                    _complete(xhr);
+                } else {
+                    // The fetch we were waiting on was not cacheable or failed.
+                    xhr._cached = false;
+                    xhr._fetch();
+                }
+            } else if (pattern === "error" && data[0] === null) {
+                // A setTimeout timer could not be scheduled.
+                _err("setTimeout: " + data[1]);
+                delete _timeouts[data[2]];
+            } else if (pattern === "error") {
+                // A socket operation failed, timed out or was cancelled.
+                let xhr = _xhrs[data[2]];
+                if (xhr) {
+                    _fail(xhr, data[1]);
+                }
             }
         }
+        for (let i = 0; i < _pools.length; i++) {
+            _pools[i].close();
+        }
         yield _sentinel;
     }
 
+    // Parse text with a dom.js parser. The document is tokenized natively
+    // and the tokens fed to the parser's tree builder through its
+    // insertToken, unless the parser does not expose it or the native
+    // tokenizer cannot handle the document; then the parser tokenizes it
+    // in JS with end(text) as before. Which path each parse took, and the
+    // time spent on each, is counted in parseHTML.stats, and the first
+    // fallback for each reason is logged, so a dom.js without the entry
+    // point cannot silently leave the native tokenizer unused.
+    let _EOF = -1;
+    function parseHTML(parser, text) {
+        let started = Date.now();
+        let reason = null;
+        let tokens = null;
+        if (typeof parser.insertToken !== "function" ||
+            typeof parser.document !== "function") {
+            reason = "parser has no insertToken";
+        } else {
+            tokens = html_tokenize(text);
+            if (!tokens) {
+                reason = "document not supported by html_tokenize";
+            }
+        }
+
+        let stats = parseHTML.stats;
+        let doc;
+        if (reason) {
+            if (!stats.reasons[reason]) {
+                stats.reasons[reason] = 0;
+                _err("parseHTML: using the JS tokenizer, " + reason);
+            }
+            stats.reasons[reason]++;
+            doc = parser.end(text);
+            stats.fallback++;
+            stats.fallback_ms += Date.now() - started;
+            return doc;
+        }
+        for (let i = 0; i < tokens.length; i += 4) {
+            parser.insertToken(tokens[i], tokens[i + 1], tokens[i + 2], tokens[i + 3]);
+        }
+        parser.insertToken(_EOF);
+        doc = parser.document();
+        stats.native++;
+        stats.native_ms += Date.now() - started;
+        return doc;
+    }
+    parseHTML.stats = { native: 0, native_ms: 0, fallback: 0, fallback_ms: 0, reasons: {} };
+
     function resume() {
         try {
            return _actor_main();
         } catch (e) {
             if (e instanceof StopIteration) {
-                return;
+                return null;
             }
             _err('Error in Actor:');
             //print(_script);
             _err(e);
             _err(e.stack);
+            // Returning null lets the runtime destroy us and tell our parent.
+            globs._exit_reason = String(e);
+            return null;
         }
     }
     globs.window.setTimeout = setTimeout;
@@ -416,6 +853,10 @@
     globs.receive = receive;
     globs.connect = connect;
     globs.XMLHttpRequest = XMLHttpRequest;
+    globs.Pool = Pool;
+    globs.serve = serve;
+    globs.done = done;
+    globs.parseHTML = parseHTML;
 })(this);
 
 "Hello"
@@ -0,0 +1,1052 @@
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_BUCKETS 4096
+#define DISK_MAGIC 0x43565254
+
+#pragma mark cache state
+
+typedef struct _cache_entry {
+    char * url;
+    uint64_t hash;
+    char * data;             // raw http response, inside map if mapped
+    size_t length;
+    char * map;              // the spilled file this entry was loaded from
+    size_t map_length;
+    int dirty;               // not yet on disk as it is now
+    time_t expires;          // fresh until then, 0 means always revalidate
+    char * etag;
+    char * last_modified;
+    char * vary;             // the response's Vary header, or NULL
+    char * vary_key;         // the request's values of the headers it names
+    int linked;              // in buckets and the lru list
+    int refs;                // queued disk jobs and readers without the lock
+    int discarded;           // queued to spill, but the url is not cacheable now
+    struct _cache_entry * hash_next;
+    struct _cache_entry * lru_prev;  // more recently used
+    struct _cache_entry * lru_next;  // less recently used
+} CacheEntry;
+
+typedef struct _waiter {
+    void * owner;
+    uint32_t tag;
+    char * request_headers;
+} Waiter;
+
+// A fetch in progress, and who is waiting for it.
+typedef struct _inflight {
+    char * url;
+    void * leader;
+    Waiter * waiters;
+    int nwaiters;
+    int waiters_capacity;
+    struct _inflight * next;
+} Inflight;
+
+// On disk each entry is a header followed by the url, etag,
+// last_modified, vary, vary_key and response bytes.
+typedef struct _disk_header {
+    uint32_t magic;
+    uint32_t url_length;
+    uint32_t etag_length;
+    uint32_t last_modified_length;
+    uint32_t vary_length;
+    uint32_t vary_key_length;
+    int64_t expires;
+    uint64_t length;
+} DiskHeader;
+
+// Writing an entry that left memory, or deleting a url's file if it still
+// holds that url. Run in the order queued.
+typedef struct _disk_job {
+    CacheEntry * entry;      // to spill, or NULL
+    char * url;              // to delete, or NULL
+    uint64_t hash;
+    struct _disk_job * next;
+} DiskJob;
+
+// A file in the cache directory, named by url hash.
+typedef struct _disk_file {
+    uint64_t hash;
+    size_t size;
+    struct _disk_file * hash_next;
+    struct _disk_file * lru_prev;    // more recently used
+    struct _disk_file * lru_next;    // less recently used
+} DiskFile;
+
+// cache_mutex guards everything below; files are only read, written and
+// deleted without it. disk_mutex is held by whoever runs the disk jobs,
+// which keeps changes to the directory in order, and is taken first.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry * buckets[CACHE_BUCKETS];
+static CacheEntry * lru_head = NULL;
+static CacheEntry * lru_tail = NULL;
+static size_t memory_used = 0;
+static size_t memory_limit = 0;
+static DiskFile * disk_buckets[CACHE_BUCKETS];
+static DiskFile * disk_lru_head = NULL;
+static DiskFile * disk_lru_tail = NULL;
+static size_t disk_used = 0;
+static size_t disk_limit = 0;
+static DiskJob * disk_jobs_head = NULL;
+static DiskJob * disk_jobs_tail = NULL;
+// Bumped whenever a job changes a file, so a read made meanwhile is retried.
+static uint32_t disk_generation[CACHE_BUCKETS];
+static uint64_t * doomed = NULL;     // files forgotten but not yet deleted
+static int ndoomed = 0;
+static int doomed_capacity = 0;
+static CacheEntry * garbage = NULL;  // entries no one holds, to be freed
+static char * directory = NULL;
+static Inflight * inflight = NULL;
+static CacheDeliver deliver = NULL;
+
+static char * copy_bytes(const char * data, size_t length) {
+    char * copy = (char *)malloc(length + 1);
+    memcpy(copy, data, length);
+    copy[length] = 0;
+    return copy;
+}
+
+static char * copy_string(const char * string) {
+    return string ? copy_bytes(string, strlen(string)) : NULL;
+}
+
+static uint64_t hash_url(const char * url) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char * p = url; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#pragma mark http headers
+
+// Returns a malloced copy of the named header's value among the CRLF
+// separated header lines from line to end, or NULL.
+static char * find_header(const char * line, const char * end, const char * name) {
+    size_t name_length = strlen(name);
+    while (line < end) {
+        const char * eol = (const char *)memmem(line, end - line, "\r\n", 2);
+        if (!eol)
+            eol = end;
+        if ((size_t)(eol - line) > name_length && line[name_length] == ':' &&
+            !strncasecmp(line, name, name_length)) {
+            const char * value = line + name_length + 1;
+            while (value < eol && *value == ' ')
+                value++;
+            return copy_bytes(value, eol - value);
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+// Returns a malloced copy of the named response header's value, or NULL.
+static char * header_value(const char * response, size_t length, const char * name) {
+    const char * end = (const char *)memmem(response, length, "\r\n\r\n", 4);
+    if (!end)
+        return NULL;
+    const char * line = (const char *)memmem(response, end - response, "\r\n", 2);
+    return line ? find_header(line + 2, end + 2, name) : NULL;
+}
+
+// The values the request headers give the headers named by a response's
+// Vary, one "name:value" line each. Two requests get the same response
+// only if their keys match.
+static char * vary_key(const char * vary, const char * request_headers) {
+    size_t length = 0, capacity = 64;
+    char * key = (char *)malloc(capacity);
+    if (!request_headers)
+        request_headers = "";
+    const char * headers_end = request_headers + strlen(request_headers);
+    const char * p = vary;
+    while (*p) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        const char * start = p;
+        while (*p && *p != ',' && *p != ' ')
+            p++;
+        if (p == start)
+            continue;
+        char * name = copy_bytes(start, p - start);
+        char * value = find_header(request_headers, headers_end, name);
+        size_t needed = length + strlen(name) + (value ? strlen(value) : 0) + 3;
+        if (needed > capacity) {
+            capacity = needed * 2;
+            key = (char *)realloc(key, capacity);
+        }
+        for (char * c = name; *c; c++)
+            key[length++] = tolower(*c);
+        key[length++] = ':';
+        for (char * c = value; c && *c; c++)
+            key[length++] = *c;
+        key[length++] = '\n';
+        free(name);
+        free(value);
+    }
+    key[length] = 0;
+    return key;
+}
+
+// Whether a request with these headers may be given the entry's response.
+static int entry_matches(CacheEntry * entry, const char * request_headers) {
+    if (!entry->vary)
+        return 1;
+    char * key = vary_key(entry->vary, request_headers);
+    int matches = !strcmp(key, entry->vary_key);
+    free(key);
+    return matches;
+}
+
+static int response_status(const char * response, size_t length) {
+    const char * space = (const char *)memchr(response, ' ', length < 16 ? length : 16);
+    return space ? atoi(space + 1) : 0;
+}
+
+static time_t http_date(const char * value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!value || !strptime(value, "%a, %d %b %Y %H:%M:%S", &tm))
+        return 0;
+    return timegm(&tm);
+}
+
+// Work out how long a response stays fresh from Cache-Control, Expires
+// or, failing those, a tenth of its Last-Modified age. Sets *no_store
+// if the response must not be kept in a cache shared between actors.
+static time_t response_expires(const char * response, size_t length, time_t now, int * no_store) {
+    time_t expires = 0;
+    *no_store = 0;
+
+    char * cache_control = header_value(response, length, "Cache-Control");
+    if (cache_control) {
+        for (char * p = cache_control; *p; p++)
+            *p = tolower(*p);
+        if (strstr(cache_control, "no-store") || strstr(cache_control, "private")) {
+            *no_store = 1;
+        } else if (!strstr(cache_control, "no-cache")) {
+            char * max_age = strstr(cache_control, "max-age=");
+            if (max_age)
+                expires = now + atol(max_age + 8);
+        }
+        free(cache_control);
+        return expires;
+    }
+
+    char * value = header_value(response, length, "Expires");
+    if (value) {
+        expires = http_date(value);
+        free(value);
+        return expires;
+    }
+
+    value = header_value(response, length, "Last-Modified");
+    if (value) {
+        time_t modified = http_date(value);
+        if (modified && modified < now)
+            expires = now + (now - modified) / 10;
+        free(value);
+    }
+    return expires;
+}
+
+#pragma mark memory and disk store
+
+static size_t entry_size(CacheEntry * entry) {
+    return sizeof(CacheEntry) + strlen(entry->url) + entry->length;
+}
+
+static void entry_free(CacheEntry * entry) {
+    free(entry->url);
+    if (entry->map)
+        munmap(entry->map, entry->map_length);
+    else
+        free(entry->data);
+    free(entry->etag);
+    free(entry->last_modified);
+    free(entry->vary);
+    free(entry->vary_key);
+    free(entry);
+}
+
+// Entries are freed by whoever last lets go of them, after dropping the
+// lock, as munmap can be slow.
+static void garbage_push(CacheEntry * entry) {
+    entry->hash_next = garbage;
+    garbage = entry;
+}
+
+static void entry_unref(CacheEntry * entry) {
+    if (!--entry->refs && !entry->linked)
+        garbage_push(entry);
+}
+
+static void disk_path(uint64_t hash, char * path, size_t size) {
+    snprintf(path, size, "%s/%016llx", directory, (unsigned long long)hash);
+}
+
+static DiskFile * disk_find(uint64_t hash) {
+    DiskFile * file = disk_buckets[hash % CACHE_BUCKETS];
+    while (file && file->hash != hash)
+        file = file->hash_next;
+    return file;
+}
+
+static void disk_lru_unlink(DiskFile * file) {
+    if (file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        disk_lru_head = file->lru_next;
+    if (file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        disk_lru_tail = file->lru_prev;
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void disk_lru_push(DiskFile * file) {
+    file->lru_next = disk_lru_head;
+    if (disk_lru_head)
+        disk_lru_head->lru_prev = file;
+    disk_lru_head = file;
+    if (!disk_lru_tail)
+        disk_lru_tail = file;
+}
+
+// Drop the record of the file for hash, if there is one.
+static void disk_forget(uint64_t hash) {
+    DiskFile ** link = &disk_buckets[hash % CACHE_BUCKETS];
+    while (*link && (*link)->hash != hash)
+        link = &(*link)->hash_next;
+    DiskFile * file = *link;
+    if (file) {
+        *link = file->hash_next;
+        disk_lru_unlink(file);
+        disk_used -= file->size;
+        free(file);
+    }
+}
+
+// Whether the file for hash was spilled from url rather than from another
+// url with the same hash.
+static int disk_holds(const char * url, uint64_t hash) {
+    char path[1024];
+    disk_path(hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    DiskHeader header;
+    size_t url_length = strlen(url);
+    int holds = 0;
+    if (read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+        header.magic == DISK_MAGIC && header.url_length == url_length) {
+        char * stored = (char *)malloc(url_length + 1);
+        holds = read(fd, stored, url_length) == (ssize_t)url_length &&
+            !memcmp(stored, url, url_length);
+        free(stored);
+    }
+    close(fd);
+    return holds;
+}
+
+// Record that the file for hash now holds size bytes and was just used.
+// Least recently used files are forgotten while over disk_limit, and
+// queued on doomed for whoever holds disk_mutex to delete.
+static void disk_track(uint64_t hash, size_t size) {
+    DiskFile * file = disk_find(hash);
+    if (file) {
+        disk_lru_unlink(file);
+        disk_used -= file->size;
+    } else {
+        file = (DiskFile *)calloc(1, sizeof(DiskFile));
+        file->hash = hash;
+        DiskFile ** bucket = &disk_buckets[hash % CACHE_BUCKETS];
+        file->hash_next = *bucket;
+        *bucket = file;
+    }
+    file->size = size;
+    disk_used += size;
+    disk_lru_push(file);
+
+    while (disk_limit && disk_used > disk_limit && disk_lru_tail != file) {
+        if (ndoomed == doomed_capacity) {
+            doomed_capacity = doomed_capacity * 2 + 16;
+            doomed = (uint64_t *)realloc(doomed, doomed_capacity * sizeof(uint64_t));
+        }
+        doomed[ndoomed++] = disk_lru_tail->hash;
+        disk_forget(disk_lru_tail->hash);
+    }
+}
+
+// Delete the files disk_track gave up on. Called with disk_mutex held,
+// so no spill can put a new file in their place meanwhile.
+static void disk_delete_doomed() {
+    pthread_mutex_lock(&cache_mutex);
+    uint64_t * hashes = doomed;
+    int nhashes = ndoomed;
+    doomed = NULL;
+    ndoomed = doomed_capacity = 0;
+    pthread_mutex_unlock(&cache_mutex);
+
+    for (int i = 0; i < nhashes; i++) {
+        char path[1024];
+        disk_path(hashes[i], path, sizeof(path));
+        unlink(path);
+    }
+    free(hashes);
+}
+
+typedef struct _scanned_file {
+    uint64_t hash;
+    time_t mtime;
+    size_t size;
+} ScannedFile;
+
+static int compare_mtime(const void * a, const void * b) {
+    time_t left = ((const ScannedFile *)a)->mtime;
+    time_t right = ((const ScannedFile *)b)->mtime;
+    return left < right ? -1 : left > right;
+}
+
+// Index the files left by earlier runs, oldest first so that the most
+// recently written end up most recently used.
+static void disk_scan() {
+    DIR * dir = opendir(directory);
+    if (!dir)
+        return;
+    ScannedFile * files = NULL;
+    int nfiles = 0, capacity = 0;
+    struct dirent * dirent;
+    while ((dirent = readdir(dir))) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", directory, dirent->d_name);
+        char * end;
+        uint64_t hash = strtoull(dirent->d_name, &end, 16);
+        if (strlen(dirent->d_name) != 16 || *end) {
+            // A spill interrupted before its rename.
+            if (strstr(dirent->d_name, ".tmp"))
+                unlink(path);
+            continue;
+        }
+        struct stat st;
+        if (stat(path, &st))
+            continue;
+        if (nfiles == capacity) {
+            capacity = capacity * 2 + 64;
+            files = (ScannedFile *)realloc(files, capacity * sizeof(ScannedFile));
+        }
+        files[nfiles].hash = hash;
+        files[nfiles].mtime = st.st_mtime;
+        files[nfiles++].size = st.st_size;
+    }
+    closedir(dir);
+
+    if (nfiles)
+        qsort(files, nfiles, sizeof(ScannedFile), compare_mtime);
+    for (int i = 0; i < nfiles; i++)
+        disk_track(files[i].hash, files[i].size);
+    free(files);
+}
+
+static void lru_unlink(CacheEntry * entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(CacheEntry * entry) {
+    entry->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (!lru_tail)
+        lru_tail = entry;
+}
+
+static void memory_remove(CacheEntry * entry) {
+    CacheEntry ** link = &buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    lru_unlink(entry);
+    memory_used -= entry_size(entry);
+    entry->linked = 0;
+    if (!entry->refs)
+        garbage_push(entry);
+}
+
+// Write the entry to a temporary file and rename it into place. Returns
+// the file's size, or 0 if it could not be written.
+static size_t disk_spill(CacheEntry * entry) {
+    char path[1024];
+    char tmp[1040];
+    disk_path(entry->hash, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    DiskHeader header;
+    header.magic = DISK_MAGIC;
+    header.url_length = strlen(entry->url);
+    header.etag_length = entry->etag ? strlen(entry->etag) : 0;
+    header.last_modified_length = entry->last_modified ? strlen(entry->last_modified) : 0;
+    header.vary_length = entry->vary ? strlen(entry->vary) : 0;
+    header.vary_key_length = entry->vary_key ? strlen(entry->vary_key) : 0;
+    header.expires = entry->expires;
+    header.length = entry->length;
+
+    FILE * file = fopen(tmp, "w");
+    if (!file)
+        return 0;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(entry->url, 1, header.url_length, file);
+    if (entry->etag)
+        fwrite(entry->etag, 1, header.etag_length, file);
+    if (entry->last_modified)
+        fwrite(entry->last_modified, 1, header.last_modified_length, file);
+    if (entry->vary) {
+        fwrite(entry->vary, 1, header.vary_length, file);
+        fwrite(entry->vary_key, 1, header.vary_key_length, file);
+    }
+    fwrite(entry->data, 1, entry->length, file);
+    int failed = ferror(file);
+    if (fclose(file) || failed) {
+        unlink(tmp);
+        return 0;
+    }
+    if (rename(tmp, path)) {
+        unlink(tmp);
+        return 0;
+    }
+    return sizeof(header) + header.url_length + header.etag_length +
+        header.last_modified_length + header.vary_length + header.vary_key_length +
+        header.length;
+}
+
+// The entry stays backed by the file's mapping, so a reloaded response is
+// paged in from the page cache rather than copied onto the heap. Called
+// without the lock.
+static CacheEntry * disk_load(const char * url, uint64_t hash) {
+    char path[1024];
+    disk_path(hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(DiskHeader)) {
+        close(fd);
+        return NULL;
+    }
+    char * map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    CacheEntry * entry = NULL;
+    DiskHeader * header = (DiskHeader *)map;
+    size_t total = sizeof(DiskHeader) + header->url_length + header->etag_length +
+        header->last_modified_length + header->vary_length + header->vary_key_length +
+        header->length;
+    char * p = map + sizeof(DiskHeader);
+    // Different urls can share a file name, the stored url decides.
+    if (header->magic == DISK_MAGIC && total == (size_t)st.st_size &&
+        header->url_length == strlen(url) && !memcmp(p, url, header->url_length)) {
+        entry = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+        entry->url = copy_string(url);
+        entry->hash = hash;
+        p += header->url_length;
+        if (header->etag_length)
+            entry->etag = copy_bytes(p, header->etag_length);
+        p += header->etag_length;
+        if (header->last_modified_length)
+            entry->last_modified = copy_bytes(p, header->last_modified_length);
+        p += header->last_modified_length;
+        if (header->vary_length) {
+            entry->vary = copy_bytes(p, header->vary_length);
+            entry->vary_key = copy_bytes(p + header->vary_length, header->vary_key_length);
+        }
+        p += header->vary_length + header->vary_key_length;
+        entry->map = map;
+        entry->map_length = st.st_size;
+        entry->data = p;
+        entry->length = header->length;
+        entry->expires = header->expires;
+    } else {
+        munmap(map, st.st_size);
+    }
+    return entry;
+}
+
+static void disk_job_push(DiskJob * job) {
+    if (disk_jobs_tail)
+        disk_jobs_tail->next = job;
+    else
+        disk_jobs_head = job;
+    disk_jobs_tail = job;
+}
+
+// Add to memory. Least recently used entries are queued to be spilled to
+// disk, or just dropped if their file is still there as they are.
+static void memory_insert(CacheEntry * entry) {
+    CacheEntry ** bucket = &buckets[entry->hash % CACHE_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    entry->linked = 1;
+    lru_push(entry);
+    memory_used += entry_size(entry);
+
+    while (memory_used > memory_limit && lru_tail != entry) {
+        CacheEntry * victim = lru_tail;
+        if (victim->dirty || !disk_find(victim->hash)) {
+            DiskJob * job = (DiskJob *)calloc(1, sizeof(DiskJob));
+            job->entry = victim;
+            job->hash = victim->hash;
+            victim->refs++;
+            disk_job_push(job);
+        }
+        memory_remove(victim);
+    }
+}
+
+// The url's entry in memory, or one still queued to be spilled, which is
+// taken back into memory. Sets *on_disk when the url's file is worth
+// reading, i.e. no deletion of it is queued.
+static CacheEntry * find_entry(const char * url, uint64_t hash, int * on_disk) {
+    *on_disk = 0;
+    CacheEntry * entry = buckets[hash % CACHE_BUCKETS];
+    while (entry && (entry->hash != hash || strcmp(entry->url, url)))
+        entry = entry->hash_next;
+    if (entry) {
+        lru_unlink(entry);
+        lru_push(entry);
+        return entry;
+    }
+
+    // Later jobs supersede earlier ones.
+    int deleting = 0;
+    for (DiskJob * job = disk_jobs_head; job; job = job->next) {
+        if (job->hash != hash)
+            continue;
+        if (job->entry && !job->entry->discarded && !strcmp(job->entry->url, url)) {
+            entry = job->entry;
+            deleting = 0;
+        } else if (job->url && !strcmp(job->url, url)) {
+            entry = NULL;
+            deleting = 1;
+        }
+    }
+    if (entry && !entry->linked) {
+        memory_insert(entry);
+        return entry;
+    }
+    *on_disk = !deleting;
+    return NULL;
+}
+
+// find_entry, falling back to the url's file, which is read with the
+// lock dropped. The read is retried if the file may have been replaced
+// or deleted meanwhile.
+static CacheEntry * load_entry(const char * url, uint64_t hash) {
+    for (;;) {
+        int on_disk;
+        CacheEntry * entry = find_entry(url, hash, &on_disk);
+        if (entry || !on_disk)
+            return entry;
+
+        uint32_t generation = disk_generation[hash % CACHE_BUCKETS];
+        pthread_mutex_unlock(&cache_mutex);
+        CacheEntry * loaded = disk_load(url, hash);
+        pthread_mutex_lock(&cache_mutex);
+
+        if (generation != disk_generation[hash % CACHE_BUCKETS]) {
+            if (loaded)
+                garbage_push(loaded);
+            continue;
+        }
+        // Someone else may have stored or loaded the url meanwhile.
+        entry = find_entry(url, hash, &on_disk);
+        if (entry || !loaded) {
+            if (loaded)
+                garbage_push(loaded);
+            return entry;
+        }
+        memory_insert(loaded);
+        DiskFile * file = disk_find(hash);
+        if (file) {
+            disk_lru_unlink(file);
+            disk_lru_push(file);
+        }
+        return loaded;
+    }
+}
+
+// Copy the entry's response into out. The lock is dropped meanwhile, as
+// a mapped entry may have to be paged in from disk.
+static void copy_response(CacheEntry * entry, CacheResponse * out) {
+    entry->refs++;
+    pthread_mutex_unlock(&cache_mutex);
+    out->data = copy_bytes(entry->data, entry->length);
+    out->length = entry->length;
+    pthread_mutex_lock(&cache_mutex);
+    entry_unref(entry);
+}
+
+// Run the queued disk jobs in order. Called with disk_mutex held and
+// cache_mutex not, so lookups go on while files are written.
+static void disk_run_jobs() {
+    for (;;) {
+        pthread_mutex_lock(&cache_mutex);
+        DiskJob * job = disk_jobs_head;
+        if (!job) {
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+        // The job stays queued, so find_entry can still see the entry,
+        // until its file is in place. Its fields can change meanwhile on
+        // a revalidation, so a copy is written; the response is not.
+        CacheEntry copy;
+        int spill = job->entry && !job->entry->discarded;
+        if (spill) {
+            memcpy(&copy, job->entry, sizeof(CacheEntry));
+            copy.url = copy_string(job->entry->url);
+            copy.etag = copy_string(job->entry->etag);
+            copy.last_modified = copy_string(job->entry->last_modified);
+            copy.vary = copy_string(job->entry->vary);
+            copy.vary_key = copy_string(job->entry->vary_key);
+        }
+        pthread_mutex_unlock(&cache_mutex);
+
+        size_t size = 0;
+        int deleted = 0;
+        if (spill) {
+            size = disk_spill(&copy);
+            free(copy.url);
+            free(copy.etag);
+            free(copy.last_modified);
+            free(copy.vary);
+            free(copy.vary_key);
+        } else if (job->url && disk_holds(job->url, job->hash)) {
+            char path[1024];
+            disk_path(job->hash, path, sizeof(path));
+            deleted = !unlink(path);
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+        disk_jobs_head = job->next;
+        if (!disk_jobs_head)
+            disk_jobs_tail = NULL;
+        disk_generation[job->hash % CACHE_BUCKETS]++;
+        if (size)
+            disk_track(job->hash, size);
+        else if (deleted)
+            disk_forget(job->hash);
+        if (job->entry)
+            entry_unref(job->entry);
+        pthread_mutex_unlock(&cache_mutex);
+
+        disk_delete_doomed();
+        free(job->url);
+        free(job);
+    }
+}
+
+// Called without the lock at the end of every call that may have queued
+// disk work or let go of entries. Whoever gets disk_mutex runs the jobs;
+// everyone else leaves theirs to it.
+static void cache_settle() {
+    pthread_mutex_lock(&cache_mutex);
+    int jobs = disk_jobs_head != NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    // Check again after letting go of disk_mutex, in case a job was
+    // queued while it was held but after the runner found none left.
+    while (jobs && !pthread_mutex_trylock(&disk_mutex)) {
+        disk_run_jobs();
+        pthread_mutex_unlock(&disk_mutex);
+        pthread_mutex_lock(&cache_mutex);
+        jobs = disk_jobs_head != NULL;
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry * entry = garbage;
+    garbage = NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    while (entry) {
+        CacheEntry * next = entry->hash_next;
+        entry_free(entry);
+        entry = next;
+    }
+}
+
+#pragma mark coalescing
+
+static Inflight * inflight_find(const char * url) {
+    Inflight * flight = inflight;
+    while (flight && strcmp(flight->url, url))
+        flight = flight->next;
+    return flight;
+}
+
+static Inflight * inflight_detach(const char * url) {
+    Inflight ** link = &inflight;
+    while (*link && strcmp((*link)->url, url))
+        link = &(*link)->next;
+    Inflight * flight = *link;
+    if (flight)
+        *link = flight->next;
+    return flight;
+}
+
+// Tell the waiters of a detached fetch and free it. Waiters whose request
+// headers do not match the response's vary_key are told to fetch for
+// themselves. Called unlocked.
+static void inflight_finish(Inflight * flight, const char * data, size_t length,
+                            const char * vary, const char * key) {
+    for (int i = 0; i < flight->nwaiters; i++) {
+        Waiter * waiter = &flight->waiters[i];
+        int matches = 1;
+        if (data && vary) {
+            char * waiter_key = vary_key(vary, waiter->request_headers);
+            matches = !strcmp(waiter_key, key);
+            free(waiter_key);
+        }
+        deliver(waiter->owner, waiter->tag, matches ? data : NULL, matches ? length : 0);
+        free(waiter->request_headers);
+    }
+    free(flight->waiters);
+    free(flight->url);
+    free(flight);
+}
+
+#pragma mark public api
+
+void cache_init(const char * dir, size_t limit, size_t disk, CacheDeliver deliver_callback) {
+    directory = copy_string(dir);
+    memory_limit = limit;
+    disk_limit = disk;
+    deliver = deliver_callback;
+    mkdir(directory, 0700);
+    disk_scan();
+    pthread_mutex_lock(&disk_mutex);
+    disk_delete_doomed();
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+int cache_lookup(const char * url, const char * request_headers, void * owner, uint32_t tag,
+                 CacheResponse * out) {
+    memset(out, 0, sizeof(CacheResponse));
+    uint64_t hash = hash_url(url);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry * entry = load_entry(url, hash);
+    // Only one variant is kept; a request it does not match misses, and
+    // the response it fetches replaces it.
+    if (entry && !entry_matches(entry, request_headers))
+        entry = NULL;
+    if (entry && entry->expires > now) {
+        copy_response(entry, out);
+        pthread_mutex_unlock(&cache_mutex);
+        cache_settle();
+        return CACHE_HIT;
+    }
+
+    Inflight * flight = inflight_find(url);
+    if (flight) {
+        if (flight->nwaiters == flight->waiters_capacity) {
+            flight->waiters_capacity = flight->waiters_capacity ? flight->waiters_capacity * 2 : 4;
+            flight->waiters = (Waiter *)realloc(
+                flight->waiters, flight->waiters_capacity * sizeof(Waiter));
+        }
+        flight->waiters[flight->nwaiters].owner = owner;
+        flight->waiters[flight->nwaiters].tag = tag;
+        flight->waiters[flight->nwaiters].request_headers = copy_string(request_headers);
+        flight->nwaiters++;
+        pthread_mutex_unlock(&cache_mutex);
+        cache_settle();
+        return CACHE_WAIT;
+    }
+
+    flight = (Inflight *)calloc(1, sizeof(Inflight));
+    flight->url = copy_string(url);
+    flight->leader = owner;
+    flight->next = inflight;
+    inflight = flight;
+
+    int state = CACHE_MISS;
+    if (entry && (entry->etag || entry->last_modified)) {
+        out->etag = copy_string(entry->etag);
+        out->last_modified = copy_string(entry->last_modified);
+        state = CACHE_STALE;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    cache_settle();
+    return state;
+}
+
+void cache_store(const char * url, const char * request_headers,
+                 const char * response, size_t length, CacheResponse * out) {
+    memset(out, 0, sizeof(CacheResponse));
+    uint64_t hash = hash_url(url);
+    time_t now = time(NULL);
+    int status = response_status(response, length);
+    int no_store;
+    time_t expires = response_expires(response, length, now, &no_store);
+    char * etag = header_value(response, length, "ETag");
+    char * last_modified = header_value(response, length, "Last-Modified");
+    char * vary = status == 304 ? NULL : header_value(response, length, "Vary");
+    if (vary && strchr(vary, '*'))
+        no_store = 1;
+    int shared = 0;
+    char * shared_vary = NULL;
+    char * shared_key = NULL;
+
+    // A new response is copied before taking the lock.
+    CacheEntry * stored = NULL;
+    if (status != 304) {
+        out->data = copy_bytes(response, length);
+        out->length = length;
+    }
+    if (status == 200 && !no_store && (expires > now || etag || last_modified)) {
+        stored = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+        stored->url = copy_string(url);
+        stored->hash = hash;
+        stored->data = copy_bytes(response, length);
+        stored->length = length;
+        stored->expires = expires;
+        stored->etag = etag;
+        stored->last_modified = last_modified;
+        if (vary) {
+            stored->vary = vary;
+            stored->vary_key = vary_key(vary, request_headers);
+            shared_vary = copy_string(stored->vary);
+            shared_key = copy_string(stored->vary_key);
+        }
+        stored->dirty = 1;
+        etag = last_modified = vary = NULL;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    CacheEntry * entry = load_entry(url, hash);
+    if (status == 304 && (!entry || !entry_matches(entry, request_headers))) {
+        // The entry was evicted or replaced by another variant since the
+        // lookup handed out its validators. The caller stays the leader
+        // and fetches the url again.
+        pthread_mutex_unlock(&cache_mutex);
+        cache_settle();
+        free(etag);
+        free(last_modified);
+        return;
+    } else if (status == 304) {
+        // Revalidated: keep the cached body with the new freshness.
+        entry->expires = no_store ? 0 : expires;
+        entry->dirty = 1;
+        if (etag) {
+            free(entry->etag);
+            entry->etag = etag;
+            etag = NULL;
+        }
+        shared = 1;
+        shared_vary = copy_string(entry->vary);
+        shared_key = copy_string(entry->vary_key);
+        copy_response(entry, out);
+    } else {
+        if (entry)
+            memory_remove(entry);
+        if (stored) {
+            memory_insert(stored);
+            shared = 1;
+        } else {
+            // Copies queued to be spilled are not written, and the file
+            // is deleted after any that already were, unless it turns out
+            // to hold another url with the same hash.
+            int on_disk = disk_find(hash) != NULL;
+            for (DiskJob * job = disk_jobs_head; job; job = job->next) {
+                if (job->entry && job->hash == hash && !strcmp(job->entry->url, url)) {
+                    job->entry->discarded = 1;
+                    on_disk = 1;
+                }
+            }
+            if (on_disk) {
+                DiskJob * job = (DiskJob *)calloc(1, sizeof(DiskJob));
+                job->url = copy_string(url);
+                job->hash = hash;
+                disk_job_push(job);
+                disk_generation[hash % CACHE_BUCKETS]++;
+            }
+        }
+    }
+    Inflight * flight = inflight_detach(url);
+    pthread_mutex_unlock(&cache_mutex);
+    cache_settle();
+
+    free(etag);
+    free(last_modified);
+    free(vary);
+    if (flight) {
+        // Uncacheable responses are not shared, waiters fetch for themselves.
+        inflight_finish(flight, shared ? out->data : NULL, shared ? out->length : 0,
+                        shared_vary, shared_key);
+    }
+    free(shared_vary);
+    free(shared_key);
+}
+
+void cache_abandon(const char * url) {
+    pthread_mutex_lock(&cache_mutex);
+    Inflight * flight = inflight_detach(url);
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (flight)
+        inflight_finish(flight, NULL, 0, NULL, NULL);
+}
+
+void cache_abandon_owner(void * owner) {
+    Inflight * abandoned = NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    Inflight ** link = &inflight;
+    while (*link) {
+        Inflight * flight = *link;
+        if (flight->leader == owner) {
+            *link = flight->next;
+            flight->next = abandoned;
+            abandoned = flight;
+        } else {
+            link = &flight->next;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    while (abandoned) {
+        Inflight * next = abandoned->next;
+        inflight_finish(abandoned, NULL, 0, NULL, NULL);
+        abandoned = next;
+    }
+}
+
+void cache_response_free(CacheResponse * response) {
+    free(response->data);
+    free(response->etag);
+    free(response->last_modified);
+}
@@ -0,0 +1,70 @@
+#ifndef SERVO_CACHE_H
+#define SERVO_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ****************************************************
+// Runtime-wide HTTP response cache shared by all actors.
+// Responses are kept whole, status line through body. Recently used
+// entries live in memory; entries evicted from memory are spilled to
+// one file per url under the cache directory and mmapped back in, the
+// mapping serving as the entry's storage. Least recently used files are
+// deleted to keep the directory within its disk limit.
+// Files are read and written with the cache lock dropped, so lookups
+// answered from memory never wait on the disk.
+// Concurrent fetches of the same url are coalesced: the first caller
+// becomes the leader and fetches, the others wait for its result.
+// Responses marked private, or varying on everything, are not kept. A
+// response that varies on request headers is only given to requests
+// whose values for them match the one that fetched it; one such variant
+// is kept per url.
+// ****************************************************
+
+enum {
+    CACHE_MISS,   // not cached: fetch, then cache_store or cache_abandon
+    CACHE_STALE,  // cached but stale: revalidate with the returned validators
+    CACHE_HIT,    // fresh copy returned
+    CACHE_WAIT    // being fetched by another leader, the waiter will be told
+};
+
+typedef struct _cache_response {
+    char * data;             // raw http response
+    size_t length;
+    char * etag;             // validators of a stale entry, or NULL
+    char * last_modified;
+} CacheResponse;
+
+// Called once per waiter when the leader stores or abandons the url.
+// data is NULL if the waiter has to fetch the url itself. Never called
+// with the cache lock held.
+typedef void (*CacheDeliver)(void * waiter, uint32_t tag, const char * data, size_t length);
+
+// disk_limit is in bytes, 0 for no limit. Files left by an earlier run
+// count against it.
+void cache_init(const char * directory, size_t memory_limit, size_t disk_limit,
+                CacheDeliver deliver);
+
+// request_headers are the request's "Name: value" lines, CRLF separated.
+// owner is recorded as the leader on CACHE_MISS and CACHE_STALE, or
+// queued as a waiter together with tag on CACHE_WAIT.
+int cache_lookup(const char * url, const char * request_headers, void * owner, uint32_t tag,
+                 CacheResponse * out);
+
+// The leader finished fetching url with request_headers, as passed to its
+// lookup. Fills out with the response to use,
+// which is the cached copy when response is a 304 revalidation. If that
+// copy has been evicted since, out->data is NULL and the caller is still
+// the leader: it should fetch url again without validators.
+void cache_store(const char * url, const char * request_headers,
+                 const char * response, size_t length, CacheResponse * out);
+
+// The leader gave up on url; its waiters are told to fetch it themselves.
+void cache_abandon(const char * url);
+
+// Abandon every fetch led by owner, e.g. because the owner died.
+void cache_abandon_owner(void * owner);
+
+void cache_response_free(CacheResponse * response);
+
+#endif
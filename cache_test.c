@@ -0,0 +1,285 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+// ****************************************************
+// Standalone checks for cache.c, run by make check. The cache is
+// runtime-wide, so every check shares one cache in a fresh temporary
+// directory, with a memory limit small enough that entries keep
+// spilling to disk and being mapped back in.
+// ****************************************************
+
+#define MEMORY_LIMIT 1024
+#define DISK_LIMIT 64 * 1024
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+// What the last delivery to each waiter tag was.
+static pthread_mutex_t delivered_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int delivered[16];
+static char * delivered_data[16];
+
+static void deliver(void * waiter, uint32_t tag, const char * data, size_t length) {
+    if (tag >= 16)
+        return;
+    pthread_mutex_lock(&delivered_mutex);
+    delivered[tag]++;
+    free(delivered_data[tag]);
+    delivered_data[tag] = data ? strndup(data, length) : NULL;
+    pthread_mutex_unlock(&delivered_mutex);
+}
+
+static char * response(const char * status, const char * headers, const char * body) {
+    char * text = (char *)malloc(strlen(status) + strlen(headers) + strlen(body) + 32);
+    sprintf(text, "HTTP/1.1 %s\r\n%s\r\n%s", status, headers, body);
+    return text;
+}
+
+// Look url up as the leader and store a response for it. Returns what
+// cache_store handed back, NULL if nothing.
+static char * fetch(const char * url, const char * request_headers,
+                    const char * status, const char * headers, const char * body) {
+    CacheResponse out;
+    int state = cache_lookup(url, request_headers, NULL, 0, &out);
+    cache_response_free(&out);
+    if (state != CACHE_MISS && state != CACHE_STALE)
+        return NULL;
+    char * text = response(status, headers, body);
+    cache_store(url, request_headers, text, strlen(text), &out);
+    free(text);
+    free(out.etag);
+    free(out.last_modified);
+    return out.data;
+}
+
+static int lookup(const char * url, const char * request_headers, uint32_t tag, CacheResponse * out) {
+    return cache_lookup(url, request_headers, NULL, tag, out);
+}
+
+static int has_body(const char * data, const char * body) {
+    return data && strlen(data) >= strlen(body) &&
+        !strcmp(data + strlen(data) - strlen(body), body);
+}
+
+static void check_hits() {
+    CacheResponse out;
+    free(fetch("http://hit/", "", "200 OK", "Cache-Control: max-age=600\r\n", "hit body"));
+    CHECK(lookup("http://hit/", "", 0, &out) == CACHE_HIT);
+    CHECK(has_body(out.data, "hit body"));
+    cache_response_free(&out);
+}
+
+static void check_uncacheable() {
+    const char * headers[] = {
+        "Cache-Control: no-store\r\n",
+        "Cache-Control: private, max-age=600\r\n",
+        "Cache-Control: max-age=600\r\nVary: *\r\n",
+    };
+    for (int i = 0; i < 3; i++) {
+        CacheResponse out;
+        char * data = fetch("http://uncacheable/", "", "200 OK", headers[i], "body");
+        CHECK(has_body(data, "body"));
+        free(data);
+        CHECK(lookup("http://uncacheable/", "", 0, &out) == CACHE_MISS);
+        cache_response_free(&out);
+        cache_abandon("http://uncacheable/");
+    }
+
+    // A url that stops being cacheable loses its cached copy.
+    free(fetch("http://becomes-private/", "", "200 OK", "Cache-Control: max-age=600\r\n", "old"));
+    CacheResponse out;
+    CHECK(lookup("http://becomes-private/", "", 0, &out) == CACHE_HIT);
+    cache_response_free(&out);
+    char * text = response("200 OK", "Cache-Control: private\r\n", "new");
+    cache_store("http://becomes-private/", "", text, strlen(text), &out);
+    free(text);
+    CHECK(has_body(out.data, "new"));
+    cache_response_free(&out);
+    CHECK(lookup("http://becomes-private/", "", 0, &out) == CACHE_MISS);
+    cache_response_free(&out);
+    cache_abandon("http://becomes-private/");
+}
+
+static void check_coalescing() {
+    CacheResponse out;
+    CHECK(lookup("http://shared/", "", 0, &out) == CACHE_MISS);
+    cache_response_free(&out);
+    CHECK(lookup("http://shared/", "", 1, &out) == CACHE_WAIT);
+    cache_response_free(&out);
+    char * text = response("200 OK", "Cache-Control: max-age=600\r\n", "shared body");
+    cache_store("http://shared/", "", text, strlen(text), &out);
+    cache_response_free(&out);
+    free(text);
+    CHECK(delivered[1] == 1 && has_body(delivered_data[1], "shared body"));
+
+    // Waiters on an abandoned fetch are told to fetch for themselves.
+    CHECK(lookup("http://abandoned/", "", 0, &out) == CACHE_MISS);
+    cache_response_free(&out);
+    CHECK(lookup("http://abandoned/", "", 2, &out) == CACHE_WAIT);
+    cache_response_free(&out);
+    cache_abandon("http://abandoned/");
+    CHECK(delivered[2] == 1 && !delivered_data[2]);
+}
+
+static void check_vary() {
+    CacheResponse out;
+    const char * headers = "Cache-Control: max-age=600\r\nVary: Accept-Language\r\n";
+    free(fetch("http://vary/", "Accept-Language: en\r\n", "200 OK", headers, "english"));
+    CHECK(lookup("http://vary/", "accept-language: en\r\n", 0, &out) == CACHE_HIT);
+    CHECK(has_body(out.data, "english"));
+    cache_response_free(&out);
+
+    // Another language misses, and a waiter asking for a third one is
+    // not handed the response fetched for the second.
+    CHECK(lookup("http://vary/", "Accept-Language: fr\r\n", 0, &out) == CACHE_MISS);
+    cache_response_free(&out);
+    CHECK(lookup("http://vary/", "Accept-Language: de\r\n", 3, &out) == CACHE_WAIT);
+    cache_response_free(&out);
+    char * text = response("200 OK", headers, "french");
+    cache_store("http://vary/", "Accept-Language: fr\r\n", text, strlen(text), &out);
+    cache_response_free(&out);
+    free(text);
+    CHECK(delivered[3] == 1 && !delivered_data[3]);
+    CHECK(lookup("http://vary/", "Accept-Language: fr\r\n", 0, &out) == CACHE_HIT);
+    CHECK(has_body(out.data, "french"));
+    cache_response_free(&out);
+}
+
+static void check_revalidation() {
+    CacheResponse out;
+    free(fetch("http://stale/", "", "200 OK", "Cache-Control: max-age=0\r\nETag: \"v1\"\r\n",
+               "stale body"));
+    CHECK(lookup("http://stale/", "", 0, &out) == CACHE_STALE);
+    CHECK(out.etag && !strcmp(out.etag, "\"v1\""));
+    cache_response_free(&out);
+    char * text = response("304 Not Modified", "Cache-Control: max-age=600\r\n", "");
+    cache_store("http://stale/", "", text, strlen(text), &out);
+    free(text);
+    CHECK(has_body(out.data, "stale body"));
+    cache_response_free(&out);
+    CHECK(lookup("http://stale/", "", 0, &out) == CACHE_HIT);
+    cache_response_free(&out);
+
+    // A 304 for an entry that is gone leaves the leader to fetch again.
+    CHECK(lookup("http://gone/", "", 0, &out) == CACHE_MISS);
+    cache_response_free(&out);
+    text = response("304 Not Modified", "", "");
+    cache_store("http://gone/", "", text, strlen(text), &out);
+    free(text);
+    CHECK(!out.data);
+    cache_abandon("http://gone/");
+}
+
+static int count_files(const char * directory) {
+    DIR * dir = opendir(directory);
+    int count = 0;
+    struct dirent * dirent;
+    while (dir && (dirent = readdir(dir))) {
+        if (dirent->d_name[0] != '.')
+            count++;
+    }
+    if (dir)
+        closedir(dir);
+    return count;
+}
+
+// Far more than fits in memory: the early ones come back from disk.
+static void check_spill(const char * directory) {
+    char url[64], body[64];
+    for (int i = 0; i < 32; i++) {
+        snprintf(url, sizeof(url), "http://spill/%d", i);
+        snprintf(body, sizeof(body), "spilled body %d", i);
+        free(fetch(url, "", "200 OK", "Cache-Control: max-age=600\r\n", body));
+    }
+    CHECK(count_files(directory) > 0);
+    for (int i = 0; i < 32; i++) {
+        CacheResponse out;
+        snprintf(url, sizeof(url), "http://spill/%d", i);
+        snprintf(body, sizeof(body), "spilled body %d", i);
+        CHECK(lookup(url, "", 0, &out) == CACHE_HIT);
+        CHECK(has_body(out.data, body));
+        cache_response_free(&out);
+    }
+}
+
+static void * stress(void * arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    char body[2048];
+    memset(body, 'b', sizeof(body) - 1);
+    body[sizeof(body) - 1] = 0;
+    for (int i = 0; i < 2000; i++) {
+        char url[64];
+        snprintf(url, sizeof(url), "http://stress/%d", rand_r(&seed) % 64);
+        const char * request_headers = rand_r(&seed) % 2 ? "Accept: a\r\n" : "Accept: b\r\n";
+        CacheResponse out;
+        int state = cache_lookup(url, request_headers, NULL, 15, &out);
+        if (state == CACHE_HIT)
+            CHECK(has_body(out.data, body));
+        cache_response_free(&out);
+        if (state != CACHE_MISS && state != CACHE_STALE)
+            continue;
+
+        const char * headers[] = {
+            "Cache-Control: max-age=600\r\n",
+            "Cache-Control: max-age=0\r\nETag: \"e\"\r\n",
+            "Cache-Control: max-age=600\r\nVary: Accept\r\n",
+        };
+        int kind = rand_r(&seed) % 4;
+        char * text = kind == 3 ? response("500 Oops", "", body) :
+            response("200 OK", headers[kind], body);
+        cache_store(url, request_headers, text, strlen(text), &out);
+        free(text);
+        if (!out.data)
+            cache_abandon(url);
+        cache_response_free(&out);
+    }
+    return NULL;
+}
+
+static void check_threads() {
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, stress, (void *)(uintptr_t)(i + 1));
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+}
+
+int main() {
+    char directory[] = "/tmp/servo-cache-test-XXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    cache_init(directory, MEMORY_LIMIT, DISK_LIMIT, deliver);
+
+    check_hits();
+    check_uncacheable();
+    check_coalescing();
+    check_vary();
+    check_revalidation();
+    check_spill(directory);
+    check_threads();
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    system(command);
+
+    if (failures) {
+        printf("cache_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("cache_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,764 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "htmltok.h"
+
+#pragma mark tokenizer state
+
+// A string being built for the current token. It refers straight to
+// the input until something has to be decoded or lowercased, and is
+// copied into the scratch buffer from then on. Only one string is
+// built at a time, so a string in scratch always grows at the end.
+typedef struct _span {
+    const HtmlChar * direct; // start in the input, or NULL when in scratch
+    size_t offset;           // start in the scratch buffer
+    size_t length;
+} Span;
+
+typedef struct _tokenizer {
+    const HtmlChar * p;
+    const HtmlChar * end;
+    HtmlChar * scratch;
+    size_t used;
+    size_t capacity;
+    Span * attributes;       // names and values of the current tag
+    HtmlString * resolved;
+    int nattributes;
+    int attributes_capacity;
+    HtmlTokenSink sink;
+    void * closure;
+    int failed;              // out of memory; the input goes to the JS parser
+} Tokenizer;
+
+#pragma mark scanning
+
+// Find the first of four characters at or after p, or end. The needles
+// may repeat. Text, attribute values, comments and scripts are all
+// searched through here, 16 or 8 characters per step where the vector
+// units allow.
+static const HtmlChar * scan(const HtmlChar * p, const HtmlChar * end,
+                             HtmlChar a, HtmlChar b, HtmlChar c, HtmlChar d) {
+#if defined(__AVX2__)
+    __m256i va = _mm256_set1_epi16((short)a);
+    __m256i vb = _mm256_set1_epi16((short)b);
+    __m256i vc = _mm256_set1_epi16((short)c);
+    __m256i vd = _mm256_set1_epi16((short)d);
+    while (end - p >= 16) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi16(chunk, va), _mm256_cmpeq_epi16(chunk, vb)),
+            _mm256_or_si256(_mm256_cmpeq_epi16(chunk, vc), _mm256_cmpeq_epi16(chunk, vd)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask) / 2;
+        p += 16;
+    }
+#elif defined(__SSE2__)
+    __m128i va = _mm_set1_epi16((short)a);
+    __m128i vb = _mm_set1_epi16((short)b);
+    __m128i vc = _mm_set1_epi16((short)c);
+    __m128i vd = _mm_set1_epi16((short)d);
+    while (end - p >= 8) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(chunk, va), _mm_cmpeq_epi16(chunk, vb)),
+            _mm_or_si128(_mm_cmpeq_epi16(chunk, vc), _mm_cmpeq_epi16(chunk, vd)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask) / 2;
+        p += 8;
+    }
+#endif
+    while (p < end && *p != a && *p != b && *p != c && *p != d)
+        p++;
+    return p;
+}
+
+static int is_space(HtmlChar c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\f' || c == '\r';
+}
+
+static int is_alpha(HtmlChar c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static int is_alnum(HtmlChar c) {
+    return is_alpha(c) || (c >= '0' && c <= '9');
+}
+
+static HtmlChar lower(HtmlChar c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Does the input at p start with the ascii string s, ignoring case?
+static int starts_with(Tokenizer * t, const HtmlChar * p, const char * s) {
+    for (; *s; s++, p++) {
+        if (p >= t->end || lower(*p) != *s)
+            return 0;
+    }
+    return 1;
+}
+
+static const HtmlChar * skip_space(Tokenizer * t, const HtmlChar * p) {
+    while (p < t->end && is_space(*p))
+        p++;
+    return p;
+}
+
+#pragma mark building strings
+
+static void scratch_append(Tokenizer * t, const HtmlChar * chars, size_t n) {
+    if (!n || t->failed)
+        return;
+    if (t->used + n > t->capacity) {
+        size_t capacity = (t->used + n) * 2 + 256;
+        HtmlChar * scratch = (HtmlChar *)realloc(t->scratch, capacity * sizeof(HtmlChar));
+        if (!scratch) {
+            t->failed = 1;
+            return;
+        }
+        t->scratch = scratch;
+        t->capacity = capacity;
+    }
+    memcpy(t->scratch + t->used, chars, n * sizeof(HtmlChar));
+    t->used += n;
+}
+
+static void span_start(Span * s, const HtmlChar * at) {
+    s->direct = at;
+    s->offset = 0;
+    s->length = 0;
+}
+
+static void span_detach(Tokenizer * t, Span * s) {
+    if (!s->direct)
+        return;
+    s->offset = t->used;
+    scratch_append(t, s->direct, s->length);
+    s->direct = NULL;
+}
+
+// Append n input characters starting at from.
+static void span_take(Tokenizer * t, Span * s, const HtmlChar * from, size_t n) {
+    if (s->direct && s->direct + s->length != from)
+        span_detach(t, s);
+    if (!s->direct)
+        scratch_append(t, from, n);
+    s->length += n;
+}
+
+static void span_push(Tokenizer * t, Span * s, HtmlChar c) {
+    span_detach(t, s);
+    scratch_append(t, &c, 1);
+    s->length++;
+}
+
+static HtmlString resolve(Tokenizer * t, const Span * s) {
+    static const HtmlChar empty[1] = { 0 };
+    HtmlString string;
+    if (s->direct)
+        string.chars = s->direct;
+    else
+        string.chars = t->scratch ? t->scratch + s->offset : empty;
+    string.length = s->length;
+    return string;
+}
+
+// Take an input character into s, lowercased. Names are nearly always
+// lowercase already, so they stay pointing at the input.
+static void span_take_lower(Tokenizer * t, Span * s, const HtmlChar * p) {
+    if (*p >= 'A' && *p <= 'Z')
+        span_push(t, s, lower(*p));
+    else
+        span_take(t, s, p, 1);
+}
+
+// Take a carriage return, folding \r\n and a lone \r into \n.
+static void take_newline(Tokenizer * t, Span * s) {
+    span_push(t, s, '\n');
+    t->p++;
+    if (t->p < t->end && *t->p == '\n')
+        t->p++;
+}
+
+#pragma mark character references
+
+// Entities from U+00A0 to U+00FF, in code point order. These and
+// legacy_entities are the ones recognised without a semicolon.
+static const char * latin1_entities[96] = {
+    "nbsp", "iexcl", "cent", "pound", "curren", "yen", "brvbar", "sect",
+    "uml", "copy", "ordf", "laquo", "not", "shy", "reg", "macr",
+    "deg", "plusmn", "sup2", "sup3", "acute", "micro", "para", "middot",
+    "cedil", "sup1", "ordm", "raquo", "frac14", "frac12", "frac34", "iquest",
+    "Agrave", "Aacute", "Acirc", "Atilde", "Auml", "Aring", "AElig", "Ccedil",
+    "Egrave", "Eacute", "Ecirc", "Euml", "Igrave", "Iacute", "Icirc", "Iuml",
+    "ETH", "Ntilde", "Ograve", "Oacute", "Ocirc", "Otilde", "Ouml", "times",
+    "Oslash", "Ugrave", "Uacute", "Ucirc", "Uuml", "Yacute", "THORN", "szlig",
+    "agrave", "aacute", "acirc", "atilde", "auml", "aring", "aelig", "ccedil",
+    "egrave", "eacute", "ecirc", "euml", "igrave", "iacute", "icirc", "iuml",
+    "eth", "ntilde", "ograve", "oacute", "ocirc", "otilde", "ouml", "divide",
+    "oslash", "ugrave", "uacute", "ucirc", "uuml", "yacute", "thorn", "yuml"
+};
+
+typedef struct _entity {
+    const char * name;
+    uint32_t code;
+} Entity;
+
+static const Entity legacy_entities[] = {
+    {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'},
+    {"AMP", '&'}, {"LT", '<'}, {"GT", '>'}, {"QUOT", '"'},
+    {"COPY", 0xA9}, {"REG", 0xAE},
+    {NULL, 0}
+};
+
+// Common entities that need the semicolon. A name followed by a
+// semicolon that is in none of these tables makes the tokenizer give
+// up, since it may be one of the many entities not listed here.
+static const Entity entities[] = {
+    {"apos", '\''}, {"OElig", 0x152}, {"oelig", 0x153}, {"Scaron", 0x160},
+    {"scaron", 0x161}, {"Yuml", 0x178}, {"fnof", 0x192}, {"circ", 0x2C6},
+    {"tilde", 0x2DC}, {"ensp", 0x2002}, {"emsp", 0x2003}, {"thinsp", 0x2009},
+    {"zwnj", 0x200C}, {"zwj", 0x200D}, {"lrm", 0x200E}, {"rlm", 0x200F},
+    {"ndash", 0x2013}, {"mdash", 0x2014}, {"lsquo", 0x2018}, {"rsquo", 0x2019},
+    {"sbquo", 0x201A}, {"ldquo", 0x201C}, {"rdquo", 0x201D}, {"bdquo", 0x201E},
+    {"dagger", 0x2020}, {"Dagger", 0x2021}, {"bull", 0x2022}, {"hellip", 0x2026},
+    {"permil", 0x2030}, {"prime", 0x2032}, {"Prime", 0x2033}, {"lsaquo", 0x2039},
+    {"rsaquo", 0x203A}, {"oline", 0x203E}, {"frasl", 0x2044}, {"euro", 0x20AC},
+    {"trade", 0x2122}, {"larr", 0x2190}, {"uarr", 0x2191}, {"rarr", 0x2192},
+    {"darr", 0x2193}, {"harr", 0x2194}, {"minus", 0x2212}, {"infin", 0x221E},
+    {"ne", 0x2260}, {"le", 0x2264}, {"ge", 0x2265}, {"loz", 0x25CA},
+    {"spades", 0x2660}, {"clubs", 0x2663}, {"hearts", 0x2665}, {"diams", 0x2666},
+    {NULL, 0}
+};
+
+// Replacements for numeric references to the C1 controls, U+0080 to U+009F.
+static const uint16_t windows_1252[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+static int name_is(const HtmlChar * name, size_t length, const char * s) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (!s[i] || name[i] != (HtmlChar)s[i])
+            return 0;
+    }
+    return !s[i];
+}
+
+// Code point of a legacy entity, or 0.
+static uint32_t legacy_entity(const HtmlChar * name, size_t length) {
+    for (int i = 0; i < 96; i++) {
+        if (name_is(name, length, latin1_entities[i]))
+            return 0xA0 + i;
+    }
+    for (const Entity * e = legacy_entities; e->name; e++) {
+        if (name_is(name, length, e->name))
+            return e->code;
+    }
+    return 0;
+}
+
+static uint32_t entity(const HtmlChar * name, size_t length) {
+    uint32_t code = legacy_entity(name, length);
+    for (const Entity * e = entities; !code && e->name; e++) {
+        if (name_is(name, length, e->name))
+            code = e->code;
+    }
+    return code;
+}
+
+static void push_code_point(Tokenizer * t, Span * s, uint32_t code) {
+    if (code > 0xFFFF) {
+        code -= 0x10000;
+        span_push(t, s, 0xD800 + (code >> 10));
+        span_push(t, s, 0xDC00 + (code & 0x3FF));
+    } else {
+        span_push(t, s, code);
+    }
+}
+
+// t->p is at an ampersand. Decode the reference into s, or take the
+// ampersand as text if it does not start one. Returns 0 to give up.
+static int reference(Tokenizer * t, Span * s, int in_attribute) {
+    const HtmlChar * start = t->p + 1;
+    const HtmlChar * p = start;
+
+    if (p < t->end && *p == '#') {
+        int hex = 0;
+        p++;
+        if (p < t->end && (*p == 'x' || *p == 'X')) {
+            hex = 1;
+            p++;
+        }
+        const HtmlChar * digits = p;
+        uint32_t code = 0;
+        for (; p < t->end; p++) {
+            int digit;
+            if (*p >= '0' && *p <= '9')
+                digit = *p - '0';
+            else if (hex && lower(*p) >= 'a' && lower(*p) <= 'f')
+                digit = lower(*p) - 'a' + 10;
+            else
+                break;
+            code = code * (hex ? 16 : 10) + digit;
+            if (code > 0x10FFFF)
+                code = 0x110000;
+        }
+        if (p == digits) {
+            // Not a reference after all.
+            span_take(t, s, t->p, 1);
+            t->p++;
+            return 1;
+        }
+        if (p < t->end && *p == ';')
+            p++;
+        if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+            code = 0xFFFD;
+        else if (code >= 0x80 && code <= 0x9F)
+            code = windows_1252[code - 0x80];
+        push_code_point(t, s, code);
+        t->p = p;
+        return 1;
+    }
+
+    while (p < t->end && is_alnum(*p))
+        p++;
+    if (p < t->end && *p == ';' && p > start) {
+        uint32_t code = entity(start, p - start);
+        if (!code)
+            return 0;
+        push_code_point(t, s, code);
+        t->p = p + 1;
+        return 1;
+    }
+
+    // Without a semicolon only the legacy entities count, and the
+    // longest one that prefixes the name wins.
+    for (const HtmlChar * q = p; q > start; q--) {
+        uint32_t code = legacy_entity(start, q - start);
+        if (!code)
+            continue;
+        if (in_attribute && q < t->end && (is_alnum(*q) || *q == '='))
+            break;
+        push_code_point(t, s, code);
+        t->p = q;
+        return 1;
+    }
+    span_take(t, s, t->p, 1);
+    t->p++;
+    return 1;
+}
+
+#pragma mark emitting tokens
+
+static int emit(Tokenizer * t, HtmlToken * token) {
+    if (t->failed)
+        return HTML_UNSUPPORTED;
+    int result = t->sink(t->closure, token);
+    t->used = 0;
+    t->nattributes = 0;
+    return result;
+}
+
+static int emit_string(Tokenizer * t, int type, Span * s) {
+    HtmlToken token;
+    memset(&token, 0, sizeof(token));
+    token.type = type;
+    token.value = resolve(t, s);
+    return emit(t, &token);
+}
+
+#pragma mark tokenizer states
+
+// Text up to the next tag, or when rawtext_name is set the contents of
+// a script, style, title or similar element up to its end tag. Only
+// title and textarea decode references.
+static int read_text(Tokenizer * t, const char * rawtext_name, int decode) {
+    Span s;
+    int escaped = 0;
+    span_start(&s, t->p);
+    while (1) {
+        const HtmlChar * q = scan(t->p, t->end, '<', decode ? '&' : '<', '\r', 0);
+        span_take(t, &s, t->p, q - t->p);
+        t->p = q;
+        if (q == t->end)
+            break;
+        if (*q == 0)
+            return HTML_UNSUPPORTED;
+        if (*q == '\r') {
+            take_newline(t, &s);
+            continue;
+        }
+        if (*q == '&') {
+            if (!reference(t, &s, 0))
+                return HTML_UNSUPPORTED;
+            continue;
+        }
+        // A '<'. Stop if it starts markup, otherwise it is text.
+        if (rawtext_name) {
+            if (q + 1 < t->end && q[1] == '/' && starts_with(t, q + 2, rawtext_name)) {
+                const HtmlChar * after = q + 2 + strlen(rawtext_name);
+                if (after < t->end && (is_space(*after) || *after == '/' || *after == '>'))
+                    break;
+            }
+            // Scripts that open an html comment and then a nested
+            // <script> need the script data escape states.
+            if (starts_with(t, q, "<!--"))
+                escaped = 1;
+            if (escaped && starts_with(t, q, "<script"))
+                return HTML_UNSUPPORTED;
+        } else if (q + 1 < t->end &&
+                   (is_alpha(q[1]) || q[1] == '/' || q[1] == '!' || q[1] == '?')) {
+            break;
+        }
+        span_take(t, &s, q, 1);
+        t->p++;
+    }
+    if (!s.length)
+        return 0;
+    return emit_string(t, HTML_TEXT, &s);
+}
+
+// Up to the next '>', for <? ... > and other malformed markup.
+static int read_bogus_comment(Tokenizer * t, const HtmlChar * data) {
+    const HtmlChar * q = scan(data, t->end, '>', '\r', 0, '>');
+    if (q == t->end || *q != '>')
+        return HTML_UNSUPPORTED;
+    Span s;
+    span_start(&s, data);
+    s.length = q - data;
+    t->p = q + 1;
+    return emit_string(t, HTML_COMMENT, &s);
+}
+
+// t->p is just past "<!--".
+static int read_comment(Tokenizer * t) {
+    Span s;
+    span_start(&s, t->p);
+    if (starts_with(t, t->p, ">") || starts_with(t, t->p, "->")) {
+        t->p = scan(t->p, t->end, '>', '>', '>', '>') + 1;
+        return emit_string(t, HTML_COMMENT, &s);
+    }
+    while (1) {
+        const HtmlChar * q = scan(t->p, t->end, '-', '\r', 0, '-');
+        span_take(t, &s, t->p, q - t->p);
+        t->p = q;
+        if (q == t->end || *q == 0)
+            return HTML_UNSUPPORTED;
+        if (*q == '\r') {
+            take_newline(t, &s);
+            continue;
+        }
+        if (starts_with(t, q, "-->")) {
+            t->p = q + 3;
+            break;
+        }
+        if (starts_with(t, q, "--!>")) {
+            t->p = q + 4;
+            break;
+        }
+        span_take(t, &s, q, 1);
+        t->p++;
+    }
+    return emit_string(t, HTML_COMMENT, &s);
+}
+
+static int read_doctype_id(Tokenizer * t, Span * s) {
+    const HtmlChar * p = skip_space(t, t->p);
+    if (p >= t->end || (*p != '"' && *p != '\''))
+        return 0;
+    const HtmlChar * q = scan(p + 1, t->end, *p, '>', '\r', 0);
+    if (q == t->end || *q != *p)
+        return 0;
+    span_start(s, p + 1);
+    s->length = q - (p + 1);
+    t->p = q + 1;
+    return 1;
+}
+
+// t->p is just past "<!DOCTYPE".
+static int read_doctype(Tokenizer * t) {
+    HtmlToken token;
+    Span name, public_id, system_id;
+    int has_public = 0, has_system = 0;
+
+    const HtmlChar * p = skip_space(t, t->p);
+    span_start(&name, p);
+    while (p < t->end && !is_space(*p) && *p != '>') {
+        if (*p == 0)
+            return HTML_UNSUPPORTED;
+        span_take_lower(t, &name, p);
+        p++;
+    }
+    if (!name.length)
+        return HTML_UNSUPPORTED;
+    t->p = skip_space(t, p);
+    if (starts_with(t, t->p, "public")) {
+        t->p += 6;
+        if (!read_doctype_id(t, &public_id))
+            return HTML_UNSUPPORTED;
+        has_public = 1;
+        if (read_doctype_id(t, &system_id))
+            has_system = 1;
+    } else if (starts_with(t, t->p, "system")) {
+        t->p += 6;
+        if (!read_doctype_id(t, &system_id))
+            return HTML_UNSUPPORTED;
+        has_system = 1;
+    }
+    t->p = skip_space(t, t->p);
+    if (t->p >= t->end || *t->p != '>')
+        return HTML_UNSUPPORTED;
+    t->p++;
+
+    memset(&token, 0, sizeof(token));
+    token.type = HTML_DOCTYPE;
+    token.value = resolve(t, &name);
+    if (has_public)
+        token.public_id = resolve(t, &public_id);
+    if (has_system)
+        token.system_id = resolve(t, &system_id);
+    return emit(t, &token);
+}
+
+static void add_attribute(Tokenizer * t, Span * name, Span * value) {
+    HtmlString new_name = resolve(t, name);
+    for (int i = 0; i < t->nattributes; i += 2) {
+        HtmlString old = resolve(t, &t->attributes[i]);
+        // Later duplicates are dropped.
+        if (old.length == new_name.length &&
+            !memcmp(old.chars, new_name.chars, old.length * sizeof(HtmlChar)))
+            return;
+    }
+    if (t->nattributes + 2 > t->attributes_capacity) {
+        int capacity = t->attributes_capacity * 2 + 16;
+        Span * attributes = (Span *)realloc(t->attributes, capacity * sizeof(Span));
+        if (attributes)
+            t->attributes = attributes;
+        HtmlString * resolved = (HtmlString *)realloc(t->resolved, capacity * sizeof(HtmlString));
+        if (resolved)
+            t->resolved = resolved;
+        if (!attributes || !resolved) {
+            t->failed = 1;
+            return;
+        }
+        t->attributes_capacity = capacity;
+    }
+    t->attributes[t->nattributes++] = *name;
+    t->attributes[t->nattributes++] = *value;
+}
+
+static int read_attribute_value(Tokenizer * t, Span * value) {
+    const HtmlChar * p = t->p;
+    span_start(value, p);
+    if (*p == '"' || *p == '\'') {
+        HtmlChar quote = *p;
+        t->p = p + 1;
+        span_start(value, t->p);
+        while (1) {
+            const HtmlChar * q = scan(t->p, t->end, quote, '&', '\r', 0);
+            span_take(t, value, t->p, q - t->p);
+            t->p = q;
+            if (q == t->end || *q == 0)
+                return 0;
+            if (*q == quote) {
+                t->p++;
+                return 1;
+            }
+            if (*q == '\r') {
+                take_newline(t, value);
+            } else if (!reference(t, value, 1)) {
+                return 0;
+            }
+        }
+    }
+    while (t->p < t->end && !is_space(*t->p) && *t->p != '>') {
+        if (*t->p == 0)
+            return 0;
+        if (*t->p == '&') {
+            if (!reference(t, value, 1))
+                return 0;
+        } else {
+            span_take(t, value, t->p, 1);
+            t->p++;
+        }
+    }
+    return t->p < t->end;
+}
+
+// Attributes up to and including the closing '>'.
+static int read_attributes(Tokenizer * t, int * self_closing) {
+    *self_closing = 0;
+    while (1) {
+        t->p = skip_space(t, t->p);
+        if (t->p >= t->end)
+            return 0;
+        if (*t->p == '>') {
+            t->p++;
+            return 1;
+        }
+        if (*t->p == '/') {
+            t->p++;
+            if (t->p < t->end && *t->p == '>') {
+                *self_closing = 1;
+                t->p++;
+                return 1;
+            }
+            continue;
+        }
+
+        Span name, value;
+        span_start(&name, t->p);
+        do {
+            if (*t->p == 0)
+                return 0;
+            span_take_lower(t, &name, t->p);
+            t->p++;
+        } while (t->p < t->end && !is_space(*t->p) &&
+                 *t->p != '/' && *t->p != '>' && *t->p != '=');
+
+        t->p = skip_space(t, t->p);
+        span_start(&value, t->p);
+        if (t->p < t->end && *t->p == '=') {
+            t->p = skip_space(t, t->p + 1);
+            if (t->p >= t->end)
+                return 0;
+            if (*t->p != '>' && !read_attribute_value(t, &value))
+                return 0;
+        }
+        add_attribute(t, &name, &value);
+    }
+}
+
+static int read_tag_name(Tokenizer * t, Span * name) {
+    span_start(name, t->p);
+    while (t->p < t->end && !is_space(*t->p) && *t->p != '/' && *t->p != '>') {
+        if (*t->p == 0)
+            return 0;
+        span_take_lower(t, name, t->p);
+        t->p++;
+    }
+    return t->p < t->end;
+}
+
+// Elements whose contents are not markup. noscript is among them
+// because dom.js parses with scripting enabled.
+static const char * rawtext_elements[] = {
+    "script", "style", "xmp", "iframe", "noembed", "noframes", "noscript", NULL
+};
+
+// t->p is just past '<' or "</".
+static int read_tag(Tokenizer * t, int type) {
+    HtmlToken token;
+    Span name;
+    int self_closing;
+
+    if (!read_tag_name(t, &name) || !read_attributes(t, &self_closing))
+        return HTML_UNSUPPORTED;
+
+    memset(&token, 0, sizeof(token));
+    token.type = type;
+    token.value = resolve(t, &name);
+    if (type == HTML_ENDTAG)
+        return emit(t, &token);
+
+    // Leave svg and math to the full parser, their contents are
+    // tokenized differently, and plaintext, which never ends.
+    const char * rawtext_name = NULL;
+    int decode = 0;
+    if (name_is(token.value.chars, token.value.length, "svg") ||
+        name_is(token.value.chars, token.value.length, "math") ||
+        name_is(token.value.chars, token.value.length, "plaintext"))
+        return HTML_UNSUPPORTED;
+    if (name_is(token.value.chars, token.value.length, "title")) {
+        rawtext_name = "title";
+        decode = 1;
+    } else if (name_is(token.value.chars, token.value.length, "textarea")) {
+        rawtext_name = "textarea";
+        decode = 1;
+    }
+    for (int i = 0; !rawtext_name && rawtext_elements[i]; i++) {
+        if (name_is(token.value.chars, token.value.length, rawtext_elements[i]))
+            rawtext_name = rawtext_elements[i];
+    }
+
+    for (int i = 0; i < t->nattributes; i++)
+        t->resolved[i] = resolve(t, &t->attributes[i]);
+    token.self_closing = self_closing;
+    token.nattributes = t->nattributes;
+    token.attributes = t->resolved;
+    int result = emit(t, &token);
+    if (result || !rawtext_name)
+        return result;
+    return read_text(t, rawtext_name, decode);
+}
+
+// t->p is at a '<' that starts markup.
+static int read_markup(Tokenizer * t) {
+    const HtmlChar * p = t->p;
+    if (starts_with(t, p, "<!--")) {
+        t->p += 4;
+        return read_comment(t);
+    }
+    if (starts_with(t, p, "<!doctype")) {
+        t->p += 9;
+        return read_doctype(t);
+    }
+    if (starts_with(t, p, "<![cdata["))
+        return HTML_UNSUPPORTED;
+    if (p[1] == '!')
+        return read_bogus_comment(t, p + 2);
+    if (p[1] == '?')
+        return read_bogus_comment(t, p + 1);
+    if (p[1] == '/') {
+        if (p + 2 >= t->end)
+            return HTML_UNSUPPORTED;
+        if (is_alpha(p[2])) {
+            t->p += 2;
+            return read_tag(t, HTML_ENDTAG);
+        }
+        if (p[2] == '>') {
+            t->p += 3;
+            return 0;
+        }
+        return read_bogus_comment(t, p + 2);
+    }
+    t->p += 1;
+    return read_tag(t, HTML_TAG);
+}
+
+#pragma mark entry point
+
+int html_tokenize(const HtmlChar * input, size_t length, HtmlTokenSink sink, void * closure) {
+    Tokenizer t;
+    memset(&t, 0, sizeof(t));
+    t.p = input;
+    t.end = input + length;
+    t.sink = sink;
+    t.closure = closure;
+
+    int result = 0;
+    while (!result && t.p < t.end) {
+        if (*t.p == '<' && t.p + 1 < t.end &&
+            (is_alpha(t.p[1]) || t.p[1] == '/' || t.p[1] == '!' || t.p[1] == '?'))
+            result = read_markup(&t);
+        else
+            result = read_text(&t, NULL, 1);
+    }
+    if (t.failed)
+        result = HTML_UNSUPPORTED;
+
+    free(t.scratch);
+    free(t.attributes);
+    free(t.resolved);
+    return result;
+}
@@ -0,0 +1,57 @@
+#ifndef SERVO_HTMLTOK_H
+#define SERVO_HTMLTOK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ****************************************************
+// Native HTML tokenizer. Splits a document into the tokens dom.js's
+// tree builder consumes, so the builder does not have to run its own
+// character-at-a-time tokenizer in JS. Covers what ordinary pages use;
+// anything it does not handle exactly (foreign content, CDATA, entities
+// it does not know, truncated markup) makes it give up so the caller
+// can hand the whole document to the JS parser instead.
+// ****************************************************
+
+// Token types, numbered as in dom.js's tree builder.
+enum {
+    HTML_TEXT = 1,
+    HTML_COMMENT = 2,
+    HTML_DOCTYPE = 3,
+    HTML_TAG = 4,
+    HTML_ENDTAG = 5
+};
+
+// Input and output are UTF-16, like jschar.
+typedef uint16_t HtmlChar;
+
+typedef struct _html_string {
+    const HtmlChar * chars;  // NULL for a missing doctype identifier
+    size_t length;
+} HtmlString;
+
+// Strings point into the input or into the tokenizer's scratch space
+// and are only valid until the sink returns.
+typedef struct _html_token {
+    int type;
+    HtmlString value;        // text, comment data, tag or doctype name
+    int self_closing;        // HTML_TAG
+    int nattributes;         // HTML_TAG: strings in attributes, which
+                             // are name, value, name, value...
+    HtmlString * attributes;
+    HtmlString public_id;    // HTML_DOCTYPE
+    HtmlString system_id;
+} HtmlToken;
+
+// Return nonzero to stop tokenizing.
+typedef int (*HtmlTokenSink)(void * closure, const HtmlToken * token);
+
+#define HTML_UNSUPPORTED -1
+
+// Returns 0 once the whole input has been tokenized, the sink's nonzero
+// return value if it stopped early, or HTML_UNSUPPORTED if the input
+// needs the full parser or memory ran out; the tokens already produced
+// should then be thrown away.
+int html_tokenize(const HtmlChar * input, size_t length, HtmlTokenSink sink, void * closure);
+
+#endif
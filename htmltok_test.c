@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htmltok.h"
+
+// ****************************************************
+// Standalone checks for htmltok.c, run by make check. Each case
+// tokenizes an ASCII document and compares a one-line dump of the
+// tokens with what dom.js's tokenizer would produce.
+// ****************************************************
+
+static int failures = 0;
+
+typedef struct _dump {
+    char text[4096];
+    size_t used;
+    int stop_after;          // tokens to accept before stopping, or -1
+} Dump;
+
+static void dump_string(Dump * dump, HtmlString string) {
+    for (size_t i = 0; i < string.length && dump->used + 8 < sizeof(dump->text); i++) {
+        HtmlChar c = string.chars[i];
+        if (c == '\n') {
+            dump->text[dump->used++] = '\\';
+            dump->text[dump->used++] = 'n';
+        } else if (c < 0x80) {
+            dump->text[dump->used++] = (char)c;
+        } else {
+            dump->used += snprintf(dump->text + dump->used, 8, "\\u%04x", c);
+        }
+    }
+    dump->text[dump->used] = 0;
+}
+
+static void dump_literal(Dump * dump, const char * literal) {
+    size_t length = strlen(literal);
+    if (dump->used + length < sizeof(dump->text)) {
+        memcpy(dump->text + dump->used, literal, length + 1);
+        dump->used += length;
+    }
+}
+
+// Text as T(...), comments as C(...), doctypes as D(name,public,system),
+// start tags as S(name attr=value ...) with a trailing / when self-closing,
+// end tags as E(name).
+static int dump_token(void * closure, const HtmlToken * token) {
+    Dump * dump = (Dump *)closure;
+    static const char * kinds = "?TCDSE";
+    char prefix[3] = { kinds[token->type], '(', 0 };
+    dump_literal(dump, prefix);
+    dump_string(dump, token->value);
+    if (token->type == HTML_DOCTYPE) {
+        dump_literal(dump, ",");
+        if (token->public_id.chars)
+            dump_string(dump, token->public_id);
+        dump_literal(dump, ",");
+        if (token->system_id.chars)
+            dump_string(dump, token->system_id);
+    }
+    for (int i = 0; i + 1 < token->nattributes; i += 2) {
+        dump_literal(dump, " ");
+        dump_string(dump, token->attributes[i]);
+        dump_literal(dump, "=");
+        dump_string(dump, token->attributes[i + 1]);
+    }
+    if (token->self_closing)
+        dump_literal(dump, "/");
+    dump_literal(dump, ")");
+    if (dump->stop_after >= 0 && !dump->stop_after--)
+        return 7;
+    return 0;
+}
+
+static int tokenize(const char * input, Dump * dump) {
+    size_t length = strlen(input);
+    HtmlChar * chars = (HtmlChar *)malloc((length + 1) * sizeof(HtmlChar));
+    for (size_t i = 0; i < length; i++)
+        chars[i] = (unsigned char)input[i];
+    dump->used = 0;
+    dump->text[0] = 0;
+    int result = html_tokenize(chars, length, dump_token, dump);
+    free(chars);
+    return result;
+}
+
+static void expect(const char * input, const char * expected) {
+    Dump dump;
+    dump.stop_after = -1;
+    int result = tokenize(input, &dump);
+    if (result != 0 || strcmp(dump.text, expected)) {
+        printf("FAIL %s\n  expected %s\n  got      %s (%d)\n", input, expected, dump.text, result);
+        failures++;
+    }
+}
+
+static void expect_unsupported(const char * input) {
+    Dump dump;
+    dump.stop_after = -1;
+    int result = tokenize(input, &dump);
+    if (result != HTML_UNSUPPORTED) {
+        printf("FAIL %s\n  expected HTML_UNSUPPORTED, got %d: %s\n", input, result, dump.text);
+        failures++;
+    }
+}
+
+int main() {
+    expect("", "");
+    expect("hello", "T(hello)");
+    expect("<p>hi</p>", "S(p)T(hi)E(p)");
+    expect("<DIV Class=a ID='b' title=\"c d\">", "S(div class=a id=b title=c d)");
+    expect("<a href=\"\">x</a>", "S(a href=)T(x)E(a)");
+    expect("<br/><img src=x />", "S(br/)S(img src=x/)");
+    expect("a &amp; b &lt;c&gt; &#65;&#x42;", "T(a & b <c> AB)");
+    expect("<a title=\"x&amp;y\">", "S(a title=x&y)");
+    expect("a\r\nb\rc", "T(a\\nb\\nc)");
+    expect("<!-- note -->x", "C( note )T(x)");
+    expect("<!---->", "C()");
+    expect("<!DOCTYPE html>", "D(html,,)");
+    expect("<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01//EN\" \"http://www.w3.org/TR/html4/strict.dtd\">",
+           "D(html,-//W3C//DTD HTML 4.01//EN,http://www.w3.org/TR/html4/strict.dtd)");
+    expect("<script>if (a<b && c>d) x();</script>", "S(script)T(if (a<b && c>d) x();)E(script)");
+    expect("<style>p > a { color: red }</style>", "S(style)T(p > a { color: red })E(style)");
+    expect("<title>a &amp; b</title>", "S(title)T(a & b)E(title)");
+    expect("1 < 2", "T(1 < 2)");
+
+    // Long runs go through the vector scan; put the delimiter at every
+    // offset within a block.
+    for (int n = 0; n < 40; n++) {
+        char input[128], expected[160];
+        memset(input, 'x', n);
+        strcpy(input + n, "<b>y</b>");
+        memset(expected, 0, sizeof(expected));
+        if (n) {
+            strcpy(expected, "T(");
+            memset(expected + 2, 'x', n);
+            strcat(expected, ")");
+        }
+        strcat(expected, "S(b)T(y)E(b)");
+        expect(input, expected);
+    }
+
+    expect_unsupported("<svg><path/></svg>");
+    expect_unsupported("<math></math>");
+    expect_unsupported("<div");
+    expect_unsupported("<!-- open");
+    expect_unsupported("&nosuchentity;");
+    expect_unsupported("<script><!--<script></script>--></script>");
+
+    // The sink can stop tokenizing early.
+    Dump dump;
+    dump.stop_after = 1;
+    int result = tokenize("<a>b</a><c>", &dump);
+    if (result != 7 || strcmp(dump.text, "S(a)T(b)")) {
+        printf("FAIL early stop: %d %s\n", result, dump.text);
+        failures++;
+    }
+
+    if (failures) {
+        printf("htmltok_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("htmltok_test: ok\n");
+    return 0;
+}
@@ -2,16 +2,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ev.h"
 #include "jsapi.h"
+#include "jsdbgapi.h"
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+#include "cache.h"
+#include "htmltok.h"
+#include "tls.h"
+#include "trace.h"
 
-JSContext *spawn(JSRuntime *rt, const char * filename);
+struct _actor;
+
+JSContext *spawn(JSRuntime *rt, const char * filename, struct _actor * parent);
+void start_actor(JSContext * cx);
 JSBool servo_cast(JSContext *cx, uintN argc, jsval *vp);
+void actor_release_pending(struct _actor * actor, int count);
+extern JSClass address_class;
+static int gc_idle_due();
 
 #define DEBUG_SPEW 0
 
@@ -23,13 +43,73 @@ JSBool servo_cast(JSContext *cx, uintN argc, jsval *vp);
 // calculate somehow?
 #define RUNTIME_SIZE 32 * 1024 * 1024
 
+// Default per-actor quotas, 0 means unlimited. Override with -D at build
+// time; a child inherits its parent's quotas unless spawn is given others.
+// A resume running longer than its resume_ms, not counting time spent
+// spawning children, is terminated through the operation callback, so
+// that limit is off unless asked for; the other limits make new I/O
+// requests throw.
+#ifndef ACTOR_MAX_RESUME_MS
+#define ACTOR_MAX_RESUME_MS 0
+#endif
+#ifndef ACTOR_MAX_FDS
+#define ACTOR_MAX_FDS 64
+#endif
+#ifndef ACTOR_MAX_PENDING
+#define ACTOR_MAX_PENDING 1024
+#endif
+#ifndef ACTOR_MAX_BYTES_IN
+#define ACTOR_MAX_BYTES_IN 256 * 1024 * 1024
+#endif
+#ifndef ACTOR_MAX_BYTES_OUT
+#define ACTOR_MAX_BYTES_OUT 16 * 1024 * 1024
+#endif
+// An actor whose resumes grow the GC heap by ACTOR_GC_BUDGET bytes has its
+// compartment collected after the resume that goes over, rather than
+// leaving it to a runtime-wide collection in the middle of someone's
+// resume.
+#ifndef ACTOR_GC_BUDGET
+#define ACTOR_GC_BUDGET 16 * 1024 * 1024
+#endif
+
+// A worker with nothing to run collects the whole runtime once the heap
+// has grown GC_IDLE_BYTES since the last collection, or actors have died.
+#define GC_IDLE_BYTES 8 * 1024 * 1024
+// Pause percentiles are taken over this many of the latest collections.
+#define GC_PAUSE_SAMPLES 1024
+// Scheduling classes, highest first. A runnable actor in a lower class
+// that has waited PRIORITY_MAX_WAIT_MS is run ahead of higher classes.
+enum { PRIORITY_INTERACTIVE, PRIORITY_NORMAL, PRIORITY_BACKGROUND, NUM_PRIORITIES };
+#define PRIORITY_MAX_WAIT_MS 100
+
+// Default socket deadlines in milliseconds, 0 for none: to establish a
+// connection, and for each read or write to make progress.
+#define CONNECT_TIMEOUT_MS 10000
+#define IO_TIMEOUT_MS 30000
+
+// How often the watchdog looks for resumes that overran their slice.
+#define WATCHDOG_INTERVAL_MS 50
+
+// Profiling: set SERVO_TRACE to a file name to record a Chrome trace of
+// the scheduler, sampling JS stacks SERVO_PROFILE_HZ times a second.
+#define PROFILE_DEFAULT_HZ 1000
+#define PROFILE_MAX_FRAMES 64
+
+// Shared response cache: memory is spilled to files in CACHE_DIRECTORY,
+// which is kept under CACHE_DISK_LIMIT bytes.
+#define CACHE_DIRECTORY ".servo-cache"
+#define CACHE_MEMORY_LIMIT 64 * 1024 * 1024
+#define CACHE_DISK_LIMIT 256 * 1024 * 1024
+
+// https: set SERVO_TLS_CA to a PEM file of extra certificates to trust,
+// e.g. a test server's self-signed one.
+
 #pragma mark inter-thread queues
 
 // ****************************************************
 // Managing the set of Actors that are ready to run
 // ****************************************************
 
-#define MAX_RUNNABLES_OUTSTANDING 4096
 #define MAX_SCHEDULE_OUTSTANDING 4096
 
 typedef struct _continuation {
@@ -38,63 +118,696 @@ typedef struct _continuation {
     jsval * tag;
     jsval * cast;
     uint32 intval; // how much to read, or how much was written, or how long to wait
-    struct _continuation * next; // the next chained continuation for this context
+    size_t length; // size of data when it is a raw byte buffer
+    char * buffer; // io_uring: bytes to send or received
+    int result;    // io_uring: result of the completed operation
+    uint32 timeout;      // ms a socket operation may wait, 0 for no limit
+    uint64_t deadline;   // monotonic usec the timeout runs out, 0 for none
+    const char * error;  // set when a socket operation failed or was cancelled
+    int want;            // TLS: wait for EV_READ or EV_WRITE instead of the usual
+#ifdef USE_IO_URING
+    struct __kernel_timespec ring_timeout; // io_uring: the timer or link timeout
+#endif
+    // The next continuation in the actor's mailbox, or, with io_uring,
+    // the next operation in flight on the same fd.
+    struct _continuation * next;
 } Continuation;
 
+// Per-actor bookkeeping, stored as the JSContext private.
+typedef struct _quotas {
+    uint32 resume_ms;
+    uint32 fds;
+    uint32 pending;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} Quotas;
+
+static const Quotas default_quotas = {
+    ACTOR_MAX_RESUME_MS, ACTOR_MAX_FDS, ACTOR_MAX_PENDING,
+    ACTOR_MAX_BYTES_IN, ACTOR_MAX_BYTES_OUT
+};
+
+typedef struct _actor {
+    JSContext * cx;              // NULL once the context has been destroyed
+    struct _actor * parent;      // receives an 'exit' message when we die
+    uint32 id;
+    int refcount;                // the live context, Address objects, children
+    int pending;                 // continuations created but not yet dispatched
+    int dead;                    // set once resume() finishes or fails
+    int destroyed;
+    // Lock-free multi-producer, single-consumer mailbox: senders push onto
+    // this stack, the worker running the actor takes the whole stack.
+    Continuation * mailbox;
+    int scheduled;               // 1 while on the run queue or running
+    struct _actor * run_next;    // link in the run queue
+    struct _actor * age_prev;    // links in its class's enqueue order
+    struct _actor * age_next;
+    int priority;                // scheduling class, inherited by children
+    uint64_t deadline;           // monotonic usec to finish by, 0 for none
+    uint64_t queued_usec;        // when it last joined the run queue
+    int * fds;                   // sockets opened by this actor
+    TlsConn ** tls;              // for each of fds, NULL unless it is TLS
+    int nfds;
+    int fds_capacity;
+    // Accounting, only touched by the thread currently running the actor.
+    uint64_t resumes;
+    uint64_t cpu_usec;           // cpu time spent in dispatch and resume()
+    uint64_t last_resume_usec;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;        // handshakes that resumed a cached session
+    uint64_t resume_started;     // monotonic usec, 0 when not running
+    uint64_t resume_excluded;    // usec of this resume not charged to it
+    Quotas quotas;               // inherited by children
+    const char * kill_reason;    // set when a quota terminated the actor
+    int sample_requested;        // the profiler wants the current JS stack
+    JSCompartment * compartment; // everything the actor allocates lives here
+    uint64_t gc_allocated;       // heap growth over its resumes since its last
+                                 // collection; approximate, as other workers
+                                 // allocate at the same time
+    int gc_requested;            // gc_collect() was called during this resume
+    uint64_t gc_collections;     // collections of its compartment
+} Actor;
+
 static int shutting_down = 0;
 
 static int actors_outstanding = 0;
+static uint32 next_actor_id = 0;
 static pthread_mutex_t actors_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int runnables_outstanding = 0;
-static Continuation *runnables[MAX_RUNNABLES_OUTSTANDING];
+// Actors with mail, each queued at most once however many messages it
+// has. Each scheduling class has a FIFO of actors without a deadline and
+// a list of actors with one, earliest deadline first. Every queued actor
+// is also on its class's enqueue-order list, whose head is the one that
+// has waited longest.
+static Actor *runnables_head[NUM_PRIORITIES];
+static Actor *runnables_tail[NUM_PRIORITIES];
+static Actor *runnables_deadlines[NUM_PRIORITIES];
+static Actor *runnables_oldest[NUM_PRIORITIES];
+static Actor *runnables_newest[NUM_PRIORITIES];
+static const char * priority_names[NUM_PRIORITIES] = {
+    "interactive", "normal", "background"
+};
 static pthread_mutex_t runnables_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t runnables_condition = PTHREAD_COND_INITIALIZER;
 
 static int schedule_outstanding = 0;
 static Continuation *schedule[MAX_SCHEDULE_OUTSTANDING];
 static pthread_mutex_t schedule_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t schedule_condition = PTHREAD_COND_INITIALIZER;
+// Wakes the main loop to arm what was added to schedule.
+static struct ev_loop * main_loop = NULL;
+static ev_async schedule_async;
+
+#ifdef USE_IO_URING
+// Reads, writes and timers go through one io_uring shared by all threads.
+// Workers fill the submission queue under ring_mutex; only the main
+// thread reaps the completion queue.
+#define RING_ENTRIES 1024
+static struct io_uring ring;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int ring_unsubmitted = 0;
+// Socket operations in flight, by fd, so socket_cancel can find them.
+static Continuation ** ring_in_flight = NULL;
+static int ring_in_flight_capacity = 0;
+
+// Called with ring_mutex held. Makes room by submitting when the
+// submission queue is full.
+static struct io_uring_sqe * ring_get_sqe() {
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+        io_uring_submit(&ring);
+        ring_unsubmitted = 0;
+        sqe = io_uring_get_sqe(&ring);
+    }
+    ring_unsubmitted++;
+    return sqe;
+}
+
+// Called with ring_mutex held. Submits early unless count entries are
+// free, so that linked entries go to the kernel together.
+static void ring_reserve(unsigned count) {
+    if (io_uring_sq_space_left(&ring) < count) {
+        io_uring_submit(&ring);
+        ring_unsubmitted = 0;
+    }
+}
+
+// Submit everything queued so far in one system call.
+void ring_flush() {
+    pthread_mutex_lock(&ring_mutex);
+    if (ring_unsubmitted) {
+        io_uring_submit(&ring);
+        ring_unsubmitted = 0;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+}
+
+// Wake the main thread out of io_uring_wait_cqe.
+void ring_wake() {
+    pthread_mutex_lock(&ring_mutex);
+    struct io_uring_sqe * sqe = ring_get_sqe();
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_submit(&ring);
+    ring_unsubmitted = 0;
+    pthread_mutex_unlock(&ring_mutex);
+}
+#endif
 
-static pthread_mutex_t reschedule_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Have the main thread pick up newly scheduled work, or notice that
+// every actor has finished.
+void wake_main_loop() {
+#ifdef USE_IO_URING
+    ring_wake();
+#else
+    ev_async_send(main_loop, &schedule_async);
+#endif
+}
 
 static jsval * cast_wait = NULL;
 static jsval * cast_send = NULL;
 static jsval * cast_recv = NULL;
 static jsval * cast_url = NULL;
-static jsval * cast_spawn = NULL;
+static jsval * cast_exit = NULL;
+static jsval * cast_cache = NULL;
+static jsval * cast_connect = NULL;
+static jsval * cast_cancel = NULL;
+
+// Continuation errors that are compared by address.
+static const char error_timeout[] = "timeout";
+static const char error_cancelled[] = "cancelled";
+
+// Time between stack samples, 0 when not profiling.
+static uint64_t profile_interval_usec = 0;
+
+// What started a collection: a worker going idle, an actor over its
+// budget or asking, or SpiderMonkey running out of room mid-resume.
+enum { GC_IDLE, GC_ACTOR, GC_ALLOCATION, NUM_GC_KINDS };
+static const char * gc_kind_names[NUM_GC_KINDS] = { "idle", "actor", "allocation" };
+static __thread int gc_kind = GC_ALLOCATION;
+
+static JSRuntime * gc_runtime = NULL;
+static int gc_actors_died = 0;        // since the last collection
+static uint32 gc_bytes_after = 0;     // heap size after the last collection
+static int gc_idle_running = 0;
+
+uint64_t now_usec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-JSBool schedule_actor(Continuation * cont) {
-    pthread_mutex_lock(&runnables_mutex);
-    if (runnables_outstanding == MAX_RUNNABLES_OUTSTANDING) {
-        // TODO block until space.
-        pthread_mutex_unlock(&runnables_mutex);
+#pragma mark actor lifetime
+
+// ****************************************************
+// Actor lifetime. An actor is marked dead when its resume()
+// finishes or fails, but its context is only destroyed once every
+// continuation already created for it has been dispatched or dropped.
+// ****************************************************
+
+Actor *actor_new(JSContext * cx, Actor * parent) {
+    Actor * actor = (Actor *)calloc(1, sizeof(Actor));
+    actor->cx = cx;
+    actor->id = __sync_add_and_fetch(&next_actor_id, 1);
+    actor->refcount = 1;
+    actor->priority = PRIORITY_NORMAL;
+    actor->quotas = default_quotas;
+    if (parent) {
+        __sync_add_and_fetch(&parent->refcount, 1);
+        actor->parent = parent;
+        actor->priority = parent->priority;
+        actor->deadline = parent->deadline;
+        actor->quotas = parent->quotas;
+    }
+    JS_SetContextPrivate(cx, (void *)actor);
+    return actor;
+}
+
+void actor_release(Actor * actor) {
+    if (__sync_sub_and_fetch(&actor->refcount, 1))
+        return;
+    if (actor->parent)
+        actor_release(actor->parent);
+    free(actor->fds);
+    free(actor->tls);
+    free(actor);
+}
+
+Actor *actor_of(JSContext * cx) {
+    return (Actor *)JS_GetContextPrivate(cx);
+}
+
+// Account for a continuation about to be created for actor. Returns
+// JS_FALSE if the actor is already dead and the message should be dropped;
+// otherwise actor->cx stays valid until the continuation is released.
+JSBool actor_add_pending(Actor * actor) {
+    if (!actor)
+        return JS_TRUE;
+    __sync_add_and_fetch(&actor->pending, 1);
+    if (actor->dead) {
+        // The worker may have released its own count in the meantime and
+        // left the destroy to whoever brings pending to 0.
+        actor_release_pending(actor, 1);
         return JS_FALSE;
     }
-    runnables[runnables_outstanding++] = cont;
+    return JS_TRUE;
+}
+
+// Takes ownership of tls, which is NULL for a plain socket.
+void actor_track_fd(Actor * actor, int fileno, TlsConn * tls) {
+    if (actor->nfds == actor->fds_capacity) {
+        actor->fds_capacity = actor->fds_capacity ? actor->fds_capacity * 2 : 8;
+        actor->fds = (int *)realloc(actor->fds, actor->fds_capacity * sizeof(int));
+        actor->tls = (TlsConn **)realloc(actor->tls, actor->fds_capacity * sizeof(TlsConn *));
+    }
+    actor->tls[actor->nfds] = tls;
+    actor->fds[actor->nfds++] = fileno;
+}
+
+// Returns 0 if the actor did not have fileno open.
+int actor_untrack_fd(Actor * actor, int fileno) {
+    for (int i = 0; i < actor->nfds; i++) {
+        if (actor->fds[i] == fileno) {
+            tls_free(actor->tls[i]);
+            actor->nfds--;
+            actor->fds[i] = actor->fds[actor->nfds];
+            actor->tls[i] = actor->tls[actor->nfds];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The TLS connection on fileno, or NULL for a plain socket. Only the
+// thread running the actor may use it.
+TlsConn * actor_tls(Actor * actor, int fileno) {
+    for (int i = 0; i < actor->nfds; i++) {
+        if (actor->fds[i] == fileno)
+            return actor->tls[i];
+    }
+    return NULL;
+}
+
+void actor_destroy(Actor * actor) {
+    JSContext * cx = actor->cx;
+
+    // JS_DestroyContext would collect the whole runtime on every death;
+    // the garbage is left for the next idle collection instead.
+    pthread_mutex_lock(&actors_mutex);
+    JS_DestroyContextNoGC(cx);
+    actor->cx = NULL;
+    actors_outstanding--;
+    __sync_add_and_fetch(&gc_actors_died, 1);
+    printf("[%p] actor dead (left %d)\n", cx, actors_outstanding);
+    if (!actors_outstanding)
+        wake_main_loop();
+    pthread_mutex_unlock(&actors_mutex);
+
+    for (int i = 0; i < actor->nfds; i++) {
+        tls_free(actor->tls[i]);
+        close(actor->fds[i]);
+    }
+    actor->nfds = 0;
+    actor_release(actor);
+}
+
+// count continuations for this actor have been dispatched or dropped.
+void actor_release_pending(Actor * actor, int count) {
+    if (__sync_sub_and_fetch(&actor->pending, count))
+        return;
+    if (actor->dead && __sync_bool_compare_and_swap(&actor->destroyed, 0, 1))
+        actor_destroy(actor);
+}
+
+// Free a continuation addressed to a dead actor without running it.
+void discard_continuation(Continuation * cont) {
+    JSRuntime * rt = JS_GetRuntime(cont->cx);
+    free(cont->buffer);
+    if (cont->cast == cast_wait || cont->cast == cast_send || cont->cast == cast_recv ||
+        cont->cast == cast_connect || cont->cast == cast_cancel) {
+        if (cont->data) {
+            JS_RemoveValueRootRT(rt, cont->data);
+            free(cont->data);
+        }
+        if (cont->tag) {
+            JS_RemoveValueRootRT(rt, cont->tag);
+            free(cont->tag);
+        }
+    } else if (cont->cast == cast_url) {
+        JS_RemoveValueRootRT(rt, cont->data);
+    } else if (cont->cast == cast_exit || cont->cast == cast_cache) {
+        free(cont->data);
+    } else if (cont->cast) {
+        free(cont->cast);
+        free(cont->data);
+    }
+    free(cont);
+}
+
+// Actors with a deadline go ahead of those without, earliest first,
+// until one without has waited PRIORITY_MAX_WAIT_MS.
+void run_queue_push(Actor * actor) {
+    pthread_mutex_lock(&runnables_mutex);
+    int priority = actor->priority;
+    actor->queued_usec = now_usec(CLOCK_MONOTONIC);
+    actor->run_next = NULL;
+    actor->age_next = NULL;
+    actor->age_prev = runnables_newest[priority];
+    if (actor->age_prev)
+        actor->age_prev->age_next = actor;
+    else
+        runnables_oldest[priority] = actor;
+    runnables_newest[priority] = actor;
+    if (!actor->deadline) {
+        if (runnables_tail[priority])
+            runnables_tail[priority]->run_next = actor;
+        else
+            runnables_head[priority] = actor;
+        runnables_tail[priority] = actor;
+    } else {
+        Actor ** link = &runnables_deadlines[priority];
+        while (*link && (*link)->deadline <= actor->deadline)
+            link = &(*link)->run_next;
+        actor->run_next = *link;
+        *link = actor;
+    }
     pthread_cond_signal(&runnables_condition);
     pthread_mutex_unlock(&runnables_mutex);
+}
+
+// Whether an actor queued at queued_usec has waited too long.
+static int run_queue_aged(uint64_t queued_usec, uint64_t now) {
+    return now - queued_usec > PRIORITY_MAX_WAIT_MS * 1000;
+}
+
+// Whether anything in a class has waited too long. New arrivals with a
+// deadline can go ahead of an old one, so this goes by the oldest actor
+// in the class, whichever list it is on.
+static int run_queue_class_aged(int priority, uint64_t now) {
+    Actor * oldest = runnables_oldest[priority];
+    return oldest && run_queue_aged(oldest->queued_usec, now);
+}
+
+// The class to run next, or -1 if nothing is runnable. Called with
+// runnables_mutex held.
+static int run_queue_class() {
+    uint64_t now = now_usec(CLOCK_MONOTONIC);
+    for (int priority = NUM_PRIORITIES - 1; priority > 0; priority--) {
+        if (run_queue_class_aged(priority, now))
+            return priority;
+    }
+    for (int priority = 0; priority < NUM_PRIORITIES; priority++) {
+        if (runnables_head[priority] || runnables_deadlines[priority])
+            return priority;
+    }
+    return -1;
+}
+
+// Take the next actor from a class: the earliest deadline, unless the
+// oldest actor without one has waited too long. Called with
+// runnables_mutex held.
+static Actor * run_queue_take(int priority) {
+    Actor * actor = runnables_deadlines[priority];
+    if (actor && !(runnables_head[priority] &&
+                   run_queue_aged(runnables_head[priority]->queued_usec,
+                                  now_usec(CLOCK_MONOTONIC)))) {
+        runnables_deadlines[priority] = actor->run_next;
+    } else {
+        actor = runnables_head[priority];
+        runnables_head[priority] = actor->run_next;
+        if (!runnables_head[priority])
+            runnables_tail[priority] = NULL;
+    }
+
+    if (actor->age_prev)
+        actor->age_prev->age_next = actor->age_next;
+    else
+        runnables_oldest[priority] = actor->age_next;
+    if (actor->age_next)
+        actor->age_next->age_prev = actor->age_prev;
+    else
+        runnables_newest[priority] = actor->age_prev;
+    actor->age_prev = actor->age_next = NULL;
+    return actor;
+}
+
+// Wait for an actor to run. Returns NULL on a spurious or shutdown wakeup,
+// or without waiting when there is nothing to run and the worker should
+// collect garbage instead.
+Actor * run_queue_pop() {
+    pthread_mutex_lock(&runnables_mutex);
+    int priority = run_queue_class();
+    if (priority < 0 && !shutting_down && !gc_idle_due()) {
+        pthread_cond_wait(&runnables_condition, &runnables_mutex);
+        priority = run_queue_class();
+    }
+    Actor * actor = NULL;
+    if (priority >= 0)
+        actor = run_queue_take(priority);
+    pthread_mutex_unlock(&runnables_mutex);
+    return actor;
+}
+
+// What a continuation is for, as the trace shows it.
+const char * cast_name(Continuation * cont) {
+    if (cont->cast == cast_wait)
+        return "wait";
+    if (cont->cast == cast_send)
+        return "send";
+    if (cont->cast == cast_recv)
+        return "recv";
+    if (cont->cast == cast_url)
+        return "url";
+    if (cont->cast == cast_exit)
+        return "exit";
+    if (cont->cast == cast_cache)
+        return "cache";
+    if (cont->cast == cast_connect)
+        return "connect";
+    if (cont->cast == cast_cancel)
+        return "cancel";
+    if (!cont->cast)
+        return "start";
+    return (const char *)cont->cast;
+}
+
+// Post a continuation to its actor's mailbox. Whichever sender finds the
+// actor idle puts it on the run queue, so it is queued exactly once.
+JSBool schedule_actor(Continuation * cont) {
+    Actor * actor = actor_of(cont->cx);
+    trace_instant("enqueue", actor->id, cast_name(cont));
+    Continuation * head;
+    do {
+        head = actor->mailbox;
+        cont->next = head;
+    } while (!__sync_bool_compare_and_swap(&actor->mailbox, head, cont));
+
+    if (__sync_bool_compare_and_swap(&actor->scheduled, 0, 1))
+        run_queue_push(actor);
     return JS_TRUE;
 }
 
+// Called by the worker when it is done with an actor. Mail that arrived
+// after the worker emptied the mailbox did not queue the actor, so
+// queue it again here.
+void actor_unschedule(Actor * actor) {
+    __sync_lock_release(&actor->scheduled);
+    __sync_synchronize();
+    if (actor->mailbox && __sync_bool_compare_and_swap(&actor->scheduled, 0, 1))
+        run_queue_push(actor);
+}
+
 JSBool schedule_cast(JSContext *cx, jsval * cast, jsval * data, jsval * tag) {
+    if (!actor_add_pending(actor_of(cx)))
+        return JS_FALSE;
     Continuation * cont = (Continuation *)malloc(sizeof(Continuation));
     cont->cx = cx;
     cont->cast = cast;
     cont->data = data;
     cont->tag = tag;
     cont->intval = 0;
+    cont->length = 0;
+    cont->buffer = NULL;
     cont->next = NULL;
+    cont->timeout = 0;
+    cont->error = NULL;
+    cont->want = 0;
+    cont->deadline = 0;
     return schedule_actor(cont);
 }
 
-int main_schedule_io(JSContext * cx, jsval * cast, jsval * data, jsval * tag, int fileno) {
+#ifdef USE_IO_URING
+// Called with ring_mutex held.
+static void ring_track(Continuation * cont) {
+    int fd = cont->intval;
+    if (fd >= ring_in_flight_capacity) {
+        int capacity = fd * 2 + 64;
+        ring_in_flight = (Continuation **)realloc(
+            ring_in_flight, capacity * sizeof(Continuation *));
+        memset(ring_in_flight + ring_in_flight_capacity, 0,
+               (capacity - ring_in_flight_capacity) * sizeof(Continuation *));
+        ring_in_flight_capacity = capacity;
+    }
+    cont->next = ring_in_flight[fd];
+    ring_in_flight[fd] = cont;
+}
+
+// Called with ring_mutex held. Cancelled operations are already gone.
+static void ring_untrack(Continuation * cont) {
+    if ((int)cont->intval >= ring_in_flight_capacity)
+        return;
+    for (Continuation ** link = &ring_in_flight[cont->intval]; *link; link = &(*link)->next) {
+        if (*link == cont) {
+            *link = cont->next;
+            cont->next = NULL;
+            return;
+        }
+    }
+}
+
+// Cancel everything in flight on the fd and close it. The cancelled
+// operations are discarded when the kernel completes them; the actor
+// hears about it through the cancel continuation straight away.
+static void ring_cancel(Continuation * cancel) {
+    int fd = cancel->intval;
+    pthread_mutex_lock(&ring_mutex);
+    Continuation * cont = NULL;
+    if (fd < ring_in_flight_capacity) {
+        cont = ring_in_flight[fd];
+        ring_in_flight[fd] = NULL;
+    }
+    while (cont) {
+        Continuation * next = cont->next;
+        cont->next = NULL;
+        cont->error = error_cancelled;
+        struct io_uring_sqe * sqe = ring_get_sqe();
+        io_uring_prep_cancel(sqe, cont, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+        cont = next;
+    }
+    // Operations on fd queued by this resume, and the cancels, must reach
+    // the kernel before the number can be reused by another socket().
+    if (ring_unsubmitted) {
+        io_uring_submit(&ring);
+        ring_unsubmitted = 0;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+    close(fd);
+    cancel->error = error_cancelled;
+    schedule_actor(cancel);
+}
+
+// Put a read or write straight on the ring from the worker running the
+// actor, instead of waiting for readiness on the main thread and doing
+// the system call on the next resume. The kernel waits for the socket
+// itself; the completion is reaped into the continuation by ring_run.
+// A connect waits for the socket to become writable. Operations with a
+// timeout get a linked timeout, which cancels them with -ECANCELED.
+void ring_submit_io(JSContext * cx, Continuation * cont) {
+    if (cont->cast == cast_cancel) {
+        ring_cancel(cont);
+        return;
+    }
+    // Connects and TLS sockets only wait for readiness; the TLS record
+    // layer does its own reads and writes when the actor is dispatched.
+    int readiness = cont->cast == cast_connect || actor_tls(actor_of(cx), cont->intval);
+    if (readiness) {
+        // Keep data for the dispatch.
+    } else if (cont->cast == cast_recv) {
+        int32 howmuch;
+        JS_ValueToInt32(cx, *cont->data, &howmuch);
+        cont->buffer = (char *)malloc(howmuch + 1);
+        cont->length = howmuch;
+    } else if (cont->cast == cast_send) {
+        JSString * str = JSVAL_TO_STRING(*cont->data);
+        cont->length = JS_GetStringEncodingLength(cx, str);
+        cont->buffer = (char *)malloc(cont->length + 1);
+        JS_EncodeStringToBuffer(str, cont->buffer, cont->length);
+    }
+    if (!readiness && cont->data) {
+        JS_RemoveValueRoot(cx, cont->data);
+        free(cont->data);
+        cont->data = NULL;
+    }
+    cont->ring_timeout.tv_sec = cont->timeout / 1000;
+    cont->ring_timeout.tv_nsec = (cont->timeout % 1000) * 1000000;
+
+    pthread_mutex_lock(&ring_mutex);
+    ring_reserve(2);
+    struct io_uring_sqe * sqe = ring_get_sqe();
+    if (readiness) {
+        int readable = cont->want ? cont->want == EV_READ : cont->cast == cast_recv;
+        io_uring_prep_poll_add(sqe, cont->intval, readable ? POLLIN : POLLOUT);
+    } else if (cont->cast == cast_recv) {
+        io_uring_prep_recv(sqe, cont->intval, cont->buffer, cont->length, 0);
+    } else {
+        io_uring_prep_send(sqe, cont->intval, cont->buffer, cont->length, 0);
+    }
+    io_uring_sqe_set_data(sqe, cont);
+    if (cont->timeout) {
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        sqe = ring_get_sqe();
+        io_uring_prep_link_timeout(sqe, &cont->ring_timeout, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+    ring_track(cont);
+    pthread_mutex_unlock(&ring_mutex);
+    trace_instant("arm", actor_of(cx)->id, cast_name(cont));
+}
+
+void ring_submit_timer(Continuation * cont) {
+    cont->ring_timeout.tv_sec = cont->intval / 1000;
+    cont->ring_timeout.tv_nsec = (cont->intval % 1000) * 1000000;
+
+    pthread_mutex_lock(&ring_mutex);
+    struct io_uring_sqe * sqe = ring_get_sqe();
+    io_uring_prep_timeout(sqe, &cont->ring_timeout, 0, 0);
+    io_uring_sqe_set_data(sqe, cont);
+    pthread_mutex_unlock(&ring_mutex);
+    trace_instant("arm", actor_of(cont->cx)->id, "wait");
+}
+#endif
+
+// Arm a socket operation, or hand a read straight back to the actor when
+// TLS has already decrypted bytes for it. The caller has added it to the
+// actor's pending count.
+static void arm_continuation(Continuation * cont) {
+    TlsConn * tls = actor_tls(actor_of(cont->cx), cont->intval);
+    if (tls && cont->cast == cast_recv && tls_pending(tls)) {
+        schedule_actor(cont);
+        return;
+    }
+#ifdef USE_IO_URING
+    ring_submit_io(cont->cx, cont);
+#else
     pthread_mutex_lock(&schedule_mutex);
     if (schedule_outstanding == MAX_SCHEDULE_OUTSTANDING) {
-        // !!! TODO block until space.
+        // !!! TODO block until space. Until then the operation is answered
+        // with an error rather than silently dropped. A cancel has already
+        // untracked its fd, so it is closed here instead; watchers still
+        // armed on it fail and report their own errors.
         pthread_mutex_unlock(&schedule_mutex);
-        return JS_FALSE;
+        if (cont->cast == cast_cancel) {
+            close(cont->intval);
+            cont->error = error_cancelled;
+        } else {
+            cont->error = "too many operations queued";
+        }
+        schedule_actor(cont);
+        return;
     }
+    schedule[schedule_outstanding++] = cont;
+    wake_main_loop();
+    pthread_mutex_unlock(&schedule_mutex);
+#endif
+}
+
+// Queue a socket operation on fileno, which fails with a 'timeout' error
+// if it cannot go ahead within timeout ms (0 for no limit).
+int main_schedule_io(JSContext * cx, jsval * cast, jsval * data, jsval * tag, int fileno,
+                     uint32 timeout) {
+    actor_add_pending(actor_of(cx));
 
     Continuation * cont = (Continuation *)malloc(sizeof(Continuation));
     cont->cx = cx;
@@ -102,28 +815,52 @@ int main_schedule_io(JSContext * cx, jsval * cast, jsval * data, jsval * tag, in
     cont->tag = tag;
     cont->cast = cast;
     cont->intval = fileno;
+    cont->length = 0;
+    cont->buffer = NULL;
     cont->next = NULL;
+    cont->timeout = timeout;
+    cont->error = NULL;
+    cont->want = 0;
+    cont->deadline = timeout ? now_usec(CLOCK_MONOTONIC) + (uint64_t)timeout * 1000 : 0;
 
-    schedule[schedule_outstanding++] = cont;
-    pthread_cond_signal(&schedule_condition);
-    pthread_mutex_unlock(&schedule_mutex);
+    arm_continuation(cont);
     return 1;
 }
 
-int main_schedule_timer(JSContext * cx, uint32 timeout, uint32 tag) {
-    pthread_mutex_lock(&schedule_mutex);
-    if (schedule_outstanding == MAX_SCHEDULE_OUTSTANDING) {
-        // TODO block until space.
-        pthread_mutex_unlock(&schedule_mutex);
-        return JS_FALSE;
+// The TLS record layer needs the socket readable or writable (want)
+// before the operation can go on. Arm the same continuation again, with
+// whatever is left of its timeout, so a peer trickling bytes cannot keep
+// the operation alive past its deadline.
+static void rearm_continuation(Continuation * cont, int want) {
+    actor_add_pending(actor_of(cont->cx));
+    cont->want = want;
+    if (cont->deadline) {
+        uint64_t now = now_usec(CLOCK_MONOTONIC);
+        if (now >= cont->deadline) {
+            cont->error = error_timeout;
+            schedule_actor(cont);
+            return;
+        }
+        cont->timeout = (cont->deadline - now + 999) / 1000;
     }
+    arm_continuation(cont);
+}
+
+int main_schedule_timer(JSContext * cx, uint32 timeout, uint32 tag) {
+    actor_add_pending(actor_of(cx));
 
     Continuation * cnt = (Continuation *)malloc(sizeof(Continuation));
     cnt->cx = cx;
     cnt->data = NULL;
     cnt->cast = cast_wait;
     cnt->intval = timeout;
+    cnt->length = 0;
+    cnt->buffer = NULL;
     cnt->next = NULL;
+    cnt->timeout = 0;
+    cnt->error = NULL;
+    cnt->want = 0;
+    cnt->deadline = 0;
 
     if (tag) {
         cnt->tag = (jsval *)malloc(sizeof(jsval));
@@ -133,42 +870,33 @@ int main_schedule_timer(JSContext * cx, uint32 timeout, uint32 tag) {
         cnt->tag = NULL;
     }
 
-    schedule[schedule_outstanding++] = cnt;
-    pthread_cond_signal(&schedule_condition);
-    pthread_mutex_unlock(&schedule_mutex);
-    return 1;
-}
-
-void main_schedule_spawn(JSContext * cx, JSString * url, uint32 tag) {
+#ifdef USE_IO_URING
+    ring_submit_timer(cnt);
+#else
     pthread_mutex_lock(&schedule_mutex);
     if (schedule_outstanding == MAX_SCHEDULE_OUTSTANDING) {
-        // TODO block until space.
+        // Answered like a socket operation; see arm_continuation.
         pthread_mutex_unlock(&schedule_mutex);
-        return;
-    }    
-    Continuation * cnt = (Continuation *)malloc(sizeof(Continuation));
-    cnt->cx = cx;
-
-    cnt->data = (jsval *)JS_EncodeString(cx, url); // so unsafe
-    cnt->cast = cast_spawn;
-    cnt->intval = tag;
-    cnt->next = NULL;
-    cnt->tag = NULL;
-
+        cnt->error = "too many operations queued";
+        schedule_actor(cnt);
+        return 1;
+    }
     schedule[schedule_outstanding++] = cnt;
-    pthread_cond_signal(&schedule_condition);
+    wake_main_loop();
     pthread_mutex_unlock(&schedule_mutex);
+#endif
+    return 1;
 }
 
-void main_schedule_cast(JSContext * cx, JSString * pattern, JSString * data) {
-    pthread_mutex_lock(&schedule_mutex);
-    if (schedule_outstanding == MAX_SCHEDULE_OUTSTANDING) {
-        // TODO block until space.
-        pthread_mutex_unlock(&schedule_mutex);
+// Messages between actors go straight to the receiver's mailbox
+// without a round trip through the main thread.
+void schedule_message(JSContext * cx, Actor * to, JSString * pattern, JSString * data) {
+    if (!actor_add_pending(to)) {
+        // Like erlang, sending to a dead actor is not an error.
         return;
-    }    
+    }
     Continuation * cnt = (Continuation *)malloc(sizeof(Continuation));
-    cnt->cx = cx;
+    cnt->cx = to->cx;
 
     size_t pattern_len = JS_GetStringEncodingLength(cx, pattern);
     cnt->cast = (jsval *)malloc(pattern_len + 1);
@@ -181,12 +909,78 @@ void main_schedule_cast(JSContext * cx, JSString * pattern, JSString * data) {
     ((char *)cnt->data)[data_len] = NULL;
 
     cnt->intval = 0;
+    cnt->length = 0;
+    cnt->buffer = NULL;
     cnt->next = NULL;
+    cnt->timeout = 0;
+    cnt->error = NULL;
+    cnt->want = 0;
+    cnt->deadline = 0;
     cnt->tag = NULL;
 
-    schedule[schedule_outstanding++] = cnt;
-    pthread_cond_signal(&schedule_condition);
-    pthread_mutex_unlock(&schedule_mutex);
+    schedule_actor(cnt);
+}
+
+// Mark a finished actor dead and tell its parent, which receives
+// cast('exit', [id, reason]). Sockets are shut down rather than closed
+// so that any armed watchers fire and their continuations drain; the
+// fds are closed when the context is destroyed. Takes ownership of reason.
+void actor_exit(Actor * actor, char * reason) {
+    trace_instant("exit", actor->id, reason);
+    actor->dead = 1;
+    __sync_synchronize();
+
+    for (int i = 0; i < actor->nfds; i++) {
+        shutdown(actor->fds[i], SHUT_RDWR);
+    }
+
+    cache_abandon_owner(actor);
+
+    Actor * parent = actor->parent;
+    if (!parent || !actor_add_pending(parent)) {
+        free(reason);
+        return;
+    }
+    Continuation * cnt = (Continuation *)malloc(sizeof(Continuation));
+    cnt->cx = parent->cx;
+    cnt->cast = cast_exit;
+    cnt->data = (jsval *)reason;
+    cnt->tag = NULL;
+    cnt->intval = actor->id;
+    cnt->length = 0;
+    cnt->buffer = NULL;
+    cnt->next = NULL;
+    cnt->timeout = 0;
+    cnt->error = NULL;
+    cnt->want = 0;
+    cnt->deadline = 0;
+    schedule_actor(cnt);
+}
+
+// Hand a cached response to an actor as cast('cache', [request_id, response]).
+// An empty response means it has to fetch the url itself. The caller holds
+// a reference on the actor, which is dropped here.
+void cache_deliver(void * waiter, uint32_t tag, const char * data, size_t length) {
+    Actor * actor = (Actor *)waiter;
+    if (actor_add_pending(actor)) {
+        Continuation * cnt = (Continuation *)malloc(sizeof(Continuation));
+        cnt->cx = actor->cx;
+        cnt->cast = cast_cache;
+        cnt->data = (jsval *)malloc(length + 1);
+        if (data)
+            memcpy((char *)cnt->data, data, length);
+        cnt->length = data ? length : 0;
+        cnt->buffer = NULL;
+        cnt->tag = NULL;
+        cnt->intval = tag;
+        cnt->next = NULL;
+        cnt->timeout = 0;
+        cnt->error = NULL;
+        cnt->want = 0;
+        cnt->deadline = 0;
+        schedule_actor(cnt);
+    }
+    actor_release(actor);
 }
 
 #pragma mark libev callbacks
@@ -197,45 +991,320 @@ void main_schedule_cast(JSContext * cx, JSString * pattern, JSString * data) {
 
 static void timer_callback(EV_P_ ev_timer *w, int revents) {
     Continuation * cont = (Continuation *)w->data;
+    trace_instant("fire", actor_of(cont->cx)->id, "wait");
 
     schedule_actor(cont);
     free(w);
 }
 
+// A socket operation armed on the main loop, with its deadline. Only the
+// main thread touches these.
+typedef struct _watch {
+    ev_io io;
+    ev_timer timer;
+    Continuation * cont;
+    struct _watch * next;        // other operations armed on the same fd
+} Watch;
+
+static Watch ** watches = NULL;  // by fd
+static int watches_capacity = 0;
+
+static void watch_finish(EV_P_ Watch * watch) {
+    ev_io_stop(EV_A_ &watch->io);
+    ev_timer_stop(EV_A_ &watch->timer);
+    for (Watch ** link = &watches[watch->cont->intval]; *link; link = &(*link)->next) {
+        if (*link == watch) {
+            *link = watch->next;
+            break;
+        }
+    }
+    free(watch);
+}
+
 static void io_callback(EV_P_ ev_io *w, int revents) {
-    Continuation * cont = (Continuation *)w->data;
+    Watch * watch = (Watch *)w->data;
+    Continuation * cont = watch->cont;
+    trace_instant("fire", actor_of(cont->cx)->id, cast_name(cont));
 
+    watch_finish(EV_A_ watch);
     schedule_actor(cont);
-    ev_io_stop(ev_default_loop(0), w);
-    free(w);
+}
+
+static void timeout_callback(EV_P_ ev_timer *w, int revents) {
+    Watch * watch = (Watch *)w->data;
+    Continuation * cont = watch->cont;
+    trace_instant("timeout", actor_of(cont->cx)->id, cast_name(cont));
+
+    watch_finish(EV_A_ watch);
+    cont->error = error_timeout;
+    schedule_actor(cont);
+}
+
+static void watch_start(EV_P_ Continuation * cont, int events) {
+    int fd = cont->intval;
+    if (fd >= watches_capacity) {
+        int capacity = fd * 2 + 64;
+        watches = (Watch **)realloc(watches, capacity * sizeof(Watch *));
+        memset(watches + watches_capacity, 0, (capacity - watches_capacity) * sizeof(Watch *));
+        watches_capacity = capacity;
+    }
+    Watch * watch = (Watch *)malloc(sizeof(Watch));
+    watch->cont = cont;
+    watch->next = watches[fd];
+    watches[fd] = watch;
+
+    ev_io_init(&watch->io, io_callback, fd, events);
+    watch->io.data = (void *)watch;
+    ev_io_start(EV_A_ &watch->io);
+    ev_timer_init(&watch->timer, timeout_callback, cont->timeout / 1000.0, 0.);
+    watch->timer.data = (void *)watch;
+    if (cont->timeout)
+        ev_timer_start(EV_A_ &watch->timer);
+}
+
+// Drop everything armed on the fd and close it, then deliver the cancel
+// continuation as the actor's error.
+static void watch_cancel(EV_P_ Continuation * cancel) {
+    int fd = cancel->intval;
+    while (fd < watches_capacity && watches[fd]) {
+        Continuation * cont = watches[fd]->cont;
+        Actor * actor = actor_of(cont->cx);
+        watch_finish(EV_A_ watches[fd]);
+        discard_continuation(cont);
+        actor_release_pending(actor, 1);
+    }
+    close(fd);
+    cancel->error = error_cancelled;
+    schedule_actor(cancel);
+}
+
+// Arm everything the workers have scheduled since the last wakeup, in
+// the order it was scheduled. The queue is copied out first so that
+// discarding cancelled continuations never waits on the GC while
+// holding schedule_mutex.
+static void schedule_callback(EV_P_ ev_async *w, int revents) {
+    static Continuation * batch[MAX_SCHEDULE_OUTSTANDING];
+    pthread_mutex_lock(&schedule_mutex);
+    int count = schedule_outstanding;
+    memcpy(batch, schedule, count * sizeof(Continuation *));
+    schedule_outstanding = 0;
+    pthread_mutex_unlock(&schedule_mutex);
+
+    for (int i = 0; i < count; i++) {
+        Continuation *to_schedule = batch[i];
+        if (to_schedule->cast == cast_wait || to_schedule->cast == cast_send ||
+            to_schedule->cast == cast_recv || to_schedule->cast == cast_connect) {
+            trace_instant("arm", actor_of(to_schedule->cx)->id, cast_name(to_schedule));
+        }
+        if (to_schedule->cast == cast_wait) {
+            ev_timer *timer = (ev_timer *)malloc(sizeof(ev_timer));
+            ev_timer_init(timer, timer_callback, to_schedule->intval / 1000.0, 0.);
+            timer->data = (void *)to_schedule;
+            ev_timer_start(EV_A_ timer);
+        } else if (to_schedule->cast == cast_send || to_schedule->cast == cast_connect) {
+            watch_start(EV_A_ to_schedule, to_schedule->want ? to_schedule->want : EV_WRITE);
+        } else if (to_schedule->cast == cast_recv) {
+            watch_start(EV_A_ to_schedule, to_schedule->want ? to_schedule->want : EV_READ);
+        } else if (to_schedule->cast == cast_cancel) {
+            watch_cancel(EV_A_ to_schedule);
+        } else {
+            schedule_actor(to_schedule);
+        }
+    }
+
+    pthread_mutex_lock(&actors_mutex);
+    if (!actors_outstanding)
+        ev_break(EV_A_ EVBREAK_ALL);
+    pthread_mutex_unlock(&actors_mutex);
+}
+
+#pragma mark garbage collection
+
+// ****************************************************
+// Every actor shares the runtime, so every collection stops every
+// worker. SpiderMonkey starts one whenever the heap passes its trigger,
+// in whichever resume happened to allocate last. Collections are moved
+// to where they cost least instead: onto workers that have nothing to
+// run, and onto the actor that made the garbage, right after its resume,
+// collecting only its compartment. The allocation trigger stays as a
+// backstop.
+// ****************************************************
+
+// Pause times in usec, the latest GC_PAUSE_SAMPLES kept for percentiles.
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t gc_pauses[GC_PAUSE_SAMPLES];
+static uint64_t gc_npauses = 0;
+static uint64_t gc_counts[NUM_GC_KINDS];
+static uint64_t gc_pause_total = 0;
+static uint64_t gc_pause_max = 0;
+static uint64_t gc_pause_last = 0;
+
+// A collection runs on the thread that asked for it.
+static __thread uint64_t gc_started = 0;
+
+// The compartment make_context just created on this thread.
+static __thread JSCompartment * gc_new_compartment = NULL;
+
+// One context per worker to collect with while it has no actor.
+static JSContext * gc_contexts[NUM_THREADS];
+
+static JSBool gc_callback(JSContext *cx, JSGCStatus status) {
+    if (status == JSGC_BEGIN) {
+        gc_started = now_usec(CLOCK_MONOTONIC);
+        trace_begin("gc", 0, gc_kind_names[gc_kind]);
+    } else if (status == JSGC_END && gc_started) {
+        uint64_t pause = now_usec(CLOCK_MONOTONIC) - gc_started;
+        gc_started = 0;
+        trace_end();
+
+        pthread_mutex_lock(&gc_mutex);
+        gc_pauses[gc_npauses++ % GC_PAUSE_SAMPLES] = pause;
+        gc_counts[gc_kind]++;
+        gc_pause_total += pause;
+        gc_pause_last = pause;
+        if (pause > gc_pause_max)
+            gc_pause_max = pause;
+        pthread_mutex_unlock(&gc_mutex);
+
+        // Only a full collection frees the compartments of dead actors.
+        if (gc_kind != GC_ACTOR) {
+            gc_bytes_after = JS_GetGCParameter(JS_GetRuntime(cx), JSGC_BYTES);
+            __sync_lock_test_and_set(&gc_actors_died, 0);
+        }
+    }
+    return JS_TRUE;
+}
+
+static JSBool compartment_callback(JSContext *cx, JSCompartment *compartment, uintN op) {
+    if (op == JSCOMPARTMENT_NEW)
+        gc_new_compartment = compartment;
+    return JS_TRUE;
+}
+
+// Whether a worker with nothing to run should collect before it waits:
+// actors have died, or the heap has grown by GC_IDLE_BYTES since the
+// last full collection. Cheap enough to ask with runnables_mutex held.
+static int gc_idle_due() {
+    if (!gc_runtime || gc_idle_running)
+        return 0;
+    return gc_actors_died ||
+        JS_GetGCParameter(gc_runtime, JSGC_BYTES) > gc_bytes_after + GC_IDLE_BYTES;
+}
+
+// Collect the whole runtime on a worker with nothing to run. Actors
+// that become runnable meanwhile wait for it on the other workers, but
+// only for as long as the allocation trigger would have made them wait
+// later. One worker collects at a time.
+static void gc_idle(int index) {
+    if (!gc_idle_due() || !__sync_bool_compare_and_swap(&gc_idle_running, 0, 1))
+        return;
+    gc_kind = GC_IDLE;
+    JS_GC(gc_contexts[index]);
+    gc_kind = GC_ALLOCATION;
+    // Not due again until there is something new to collect, even if the
+    // collection did not get to run.
+    gc_bytes_after = JS_GetGCParameter(gc_runtime, JSGC_BYTES);
+    __sync_lock_test_and_set(&gc_actors_died, 0);
+    __sync_lock_release(&gc_idle_running);
+}
+
+// Collect an actor's compartment after a resume if it asked to with
+// gc_collect() or has grown the heap by ACTOR_GC_BUDGET since its last
+// collection. Called on the actor's thread, outside its request.
+static void gc_actor(Actor * actor) {
+    if (!actor->compartment)
+        return;
+    if (!actor->gc_requested && !(ACTOR_GC_BUDGET && actor->gc_allocated >= ACTOR_GC_BUDGET))
+        return;
+    gc_kind = GC_ACTOR;
+    JS_CompartmentGC(actor->cx, actor->compartment);
+    gc_kind = GC_ALLOCATION;
+    actor->gc_requested = 0;
+    actor->gc_allocated = 0;
+    actor->gc_collections++;
+}
+
+// Before any actor is spawned or any worker started.
+static void gc_init(JSRuntime * rt) {
+    gc_runtime = rt;
+    JS_SetGCCallbackRT(rt, gc_callback);
+    JS_SetCompartmentCallback(rt, compartment_callback);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        gc_contexts[i] = JS_NewContext(rt, 8192);
+        JS_ClearContextThread(gc_contexts[i]);
+    }
 }
 
 #pragma mark api exposed to actors in js
 
 // ****************************************************
 // api exposed to Actors:
-//  fileno = connect(host, port)
+//  fileno = connect(host, port, [request_id], [timeout_ms], [tls])
 //  close(fileno)
+//  socket_cancel(fileno, [request_id])
 //  schedule_timer(timeout, request_id)
-//  schedule_read(fileno, howmuch, request_id)
-//  schedule_write(fileno, towrite, request_id)
-//  address = spawn(url)
-//  address.cast(obj)
+//  schedule_read(fileno, howmuch, [request_id], [timeout_ms])
+//  schedule_write(fileno, towrite, [request_id], [timeout_ms])
+//  address = spawn(filename, [priority], [deadline_ms], [quotas])
+//  address(pattern, message)
+//  address.id
+//  parent(pattern, message)
+//  stats = actor_stats()
+//  gc_collect()
+//  stats = gc_stats()
+//  [state, etag, last_modified] = cache_lookup(url, request_headers, request_id)
+//  response = cache_store(url, request_headers, response)
+//  cache_abandon(url)
+//  tokens = html_tokenize(text)
 // ****************************************************
 
-// *** fileno = connect(host, port)
+// Throw instead of queueing more I/O for an actor over its quotas.
+JSBool check_io_quota(JSContext *cx, Actor * actor) {
+    const Quotas * quotas = &actor->quotas;
+    if (quotas->pending && actor->pending >= (int)quotas->pending) {
+        JS_ReportError(cx, "Too many outstanding operations (%d)", actor->pending);
+        return JS_FALSE;
+    }
+    if (quotas->bytes_in && actor->bytes_in >= quotas->bytes_in) {
+        JS_ReportError(cx, "Actor has exceeded its download quota");
+        return JS_FALSE;
+    }
+    if (quotas->bytes_out && actor->bytes_out >= quotas->bytes_out) {
+        JS_ReportError(cx, "Actor has exceeded its upload quota");
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+// *** fileno = connect(host, port, [request_id], [timeout_ms], [tls])
+// The actor is sent cast('connect', [fileno, request_id]) once the
+// connection is up, or cast('error', [fileno, reason, request_id]) if it
+// fails or takes longer than timeout_ms. With tls the connection is only
+// up once the TLS handshake is done, and reads and writes on it carry
+// plaintext.
 JSBool servo_connect(JSContext *cx, uintN argc, jsval *vp) {
     JSString *string;
     char host[256];
     int port;
     int fileno = 0;
+    int tag = 0;
+    uint32 timeout = CONNECT_TIMEOUT_MS;
+    JSBool secure = JS_FALSE;
     struct hostent *hostrec;
 
-    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "Si", &string, &port);
+    int result = JS_ConvertArguments(
+        cx, argc, JS_ARGV(cx, vp), "Si/uub", &string, &port, &tag, &timeout, &secure);
     if (!result) {
         JS_ReportError(cx, "Invalid arguments to connect. Expected host, port");
         return JS_FALSE;
     }
+    Actor * actor = actor_of(cx);
+    if (actor->quotas.fds && actor->nfds >= (int)actor->quotas.fds) {
+        JS_ReportError(cx, "Too many open sockets (%d)", actor->nfds);
+        return JS_FALSE;
+    }
+    if (!check_io_quota(cx, actor))
+        return JS_FALSE;
     JS_EncodeStringToBuffer(string, host, 256);
     host[JS_GetStringLength(string)] = NULL;
     hostrec = gethostbyname(host);
@@ -254,9 +1323,26 @@ JSBool servo_connect(JSContext *cx, uintN argc, jsval *vp) {
     if (connect(fileno, (struct sockaddr *)&address, sizeof(address)) == -1) {
         if (errno != EISCONN && errno != EALREADY && errno != EINPROGRESS) {
             JS_ReportError(cx, "Error connecting %d", errno);
+            close(fileno);
             return JS_FALSE;
         }
     }
+    TlsConn * tls = NULL;
+    if (secure) {
+        tls = tls_new(fileno, host, port);
+        if (!tls) {
+            JS_ReportError(cx, "TLS is not available");
+            close(fileno);
+            return JS_FALSE;
+        }
+    }
+    actor_track_fd(actor, fileno, tls);
+
+    jsval * tagval = (jsval *)malloc(sizeof(jsval));
+    JS_NewNumberValue(cx, tag, tagval);
+    JS_AddValueRoot(cx, tagval);
+    main_schedule_io(cx, cast_connect, NULL, tagval, fileno, timeout);
+
     JS_SET_RVAL(cx, vp, INT_TO_JSVAL(fileno));
     return JS_TRUE;
 }
@@ -269,6 +1355,11 @@ JSBool servo_close(JSContext *cx, uintN argc, jsval *vp) {
         JS_ReportError(cx, "Invalid arguments to close. Expected fileno\n");
         return JS_FALSE;
     }
+    actor_untrack_fd(actor_of(cx), fileno);
+#ifdef USE_IO_URING
+    // Anything this resume queued on fileno goes to the kernel first.
+    ring_flush();
+#endif
     result = close(fileno);
     if (result == -1) {
         JS_ReportError(cx, "Close failed\n");
@@ -277,6 +1368,31 @@ JSBool servo_close(JSContext *cx, uintN argc, jsval *vp) {
     return JS_TRUE;
 }
 
+// socket_cancel(fileno, [request_id])
+// Abandon whatever is outstanding on the socket and close it. The actor
+// is sent cast('error', [fileno, 'cancelled', request_id]) instead of
+// the results of the abandoned operations.
+JSBool servo_cancel(JSContext *cx, uintN argc, jsval *vp) {
+    int fileno = 0;
+    int tag = 0;
+    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "u/u", &fileno, &tag);
+    if (!result) {
+        JS_ReportError(cx, "Invalid arguments to socket_cancel. Expected fileno");
+        return JS_FALSE;
+    }
+    if (!actor_untrack_fd(actor_of(cx), fileno)) {
+        JS_ReportError(cx, "Not an open socket: %d", fileno);
+        return JS_FALSE;
+    }
+
+    jsval * tagval = (jsval *)malloc(sizeof(jsval));
+    JS_NewNumberValue(cx, tag, tagval);
+    JS_AddValueRoot(cx, tagval);
+    main_schedule_io(cx, cast_cancel, NULL, tagval, fileno, 0);
+
+    return JS_TRUE;
+}
+
 // schedule_timer(timeout, request_id)
 JSBool servo_schedule_timer(JSContext *cx, uintN argc, jsval *vp) {
     uint32 timeout;
@@ -286,24 +1402,30 @@ JSBool servo_schedule_timer(JSContext *cx, uintN argc, jsval *vp) {
         JS_ReportError(cx, "Invalid timeout\n");
         return JS_FALSE;
     }
+    if (!check_io_quota(cx, actor_of(cx)))
+        return JS_FALSE;
 
     main_schedule_timer(cx, timeout, tag);
 
     return JS_TRUE;
 }
 
-// schedule_read(fileno, howmuch, request_id)
+// schedule_read(fileno, howmuch, [request_id], [timeout_ms])
+// Waits at most timeout_ms for data, IO_TIMEOUT_MS by default, 0 for ever.
 JSBool servo_schedule_read(JSContext *cx, uintN argc, jsval *vp) {
     int fileno = 0;
     int howmuch = 0;
     int tag = 0;
+    uint32 timeout = IO_TIMEOUT_MS;
 
     int result = JS_ConvertArguments(
-        cx, argc, JS_ARGV(cx, vp), "uu/u", &fileno, &howmuch, &tag);
+        cx, argc, JS_ARGV(cx, vp), "uu/uu", &fileno, &howmuch, &tag, &timeout);
     if (!result) {
         JS_ReportError(cx, "Invalid arguments: expected fileno, howmuch");
         return JS_FALSE;
     }
+    if (!check_io_quota(cx, actor_of(cx)))
+        return JS_FALSE;
 
     jsval * howmuchval = (jsval *)malloc(sizeof(jsval));
     JS_NewNumberValue(cx, howmuch, howmuchval);
@@ -313,22 +1435,26 @@ JSBool servo_schedule_read(JSContext *cx, uintN argc, jsval *vp) {
     JS_NewNumberValue(cx, tag, tagval);
     JS_AddValueRoot(cx, tagval);
 
-    main_schedule_io(cx, cast_recv, howmuchval, tagval, (uint32)fileno);
+    main_schedule_io(cx, cast_recv, howmuchval, tagval, (uint32)fileno, timeout);
 
     return JS_TRUE;
 }
 
-// schedule_write(fileno, towrite, request_id)
+// schedule_write(fileno, towrite, [request_id], [timeout_ms])
 JSBool servo_schedule_write(JSContext *cx, uintN argc, jsval *vp) {
     int fileno = 0;
     JSString *data;
     int tag = 0;
+    uint32 timeout = IO_TIMEOUT_MS;
 
-    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "uS/u", &fileno, &data, &tag);
+    int result = JS_ConvertArguments(
+        cx, argc, JS_ARGV(cx, vp), "uS/uu", &fileno, &data, &tag, &timeout);
     if (!result) {
         JS_ReportError(cx, "Invalid arguments: expected fileno, data");
         return JS_FALSE;
     }
+    if (!check_io_quota(cx, actor_of(cx)))
+        return JS_FALSE;
 
     jsval * tagval = (jsval *)malloc(sizeof(tagval));
     JS_NewNumberValue(cx, tag, tagval);
@@ -338,25 +1464,147 @@ JSBool servo_schedule_write(JSContext *cx, uintN argc, jsval *vp) {
     *dataval = STRING_TO_JSVAL(data);
     JS_AddValueRoot(cx, dataval);
 
-    main_schedule_io(cx, cast_send, dataval, tagval, (uint32)fileno);
+    main_schedule_io(cx, cast_send, dataval, tagval, (uint32)fileno, timeout);
 
     return JS_TRUE;
 }
 
+JSObject *new_address(JSContext *cx, Actor * actor) {
+    JSObject * address = JS_NewObject(cx, &address_class, NULL, NULL);
+    if (!address)
+        return NULL;
+    __sync_add_and_fetch(&actor->refcount, 1);
+    JS_SetPrivate(cx, address, actor);
+    JS_DefineProperty(
+        cx, address, "id", INT_TO_JSVAL(actor->id), NULL, NULL,
+        JSPROP_READONLY | JSPROP_PERMANENT | JSPROP_ENUMERATE);
+    return address;
+}
+
+// Set *quota from a numeric property of a spawn options object, leaving
+// it alone when the property is missing.
+static JSBool read_quota(JSContext *cx, JSObject * options, const char * name,
+                         uint64_t max, uint64_t * quota) {
+    jsval value;
+    if (!JS_GetProperty(cx, options, name, &value))
+        return JS_FALSE;
+    if (JSVAL_IS_VOID(value))
+        return JS_TRUE;
+    jsdouble number;
+    if (!JS_ValueToNumber(cx, value, &number) || !(number >= 0)) {
+        JS_ReportError(cx, "Invalid quota %s", name);
+        return JS_FALSE;
+    }
+    *quota = number < (jsdouble)max ? (uint64_t)number : max;
+    return JS_TRUE;
+}
+
+// Override quotas with the properties of a spawn options object:
+// resume_ms, fds, pending, bytes_in and bytes_out. 0 means unlimited.
+static JSBool read_quotas(JSContext *cx, jsval options, Quotas * quotas) {
+    if (!JSVAL_IS_OBJECT(options)) {
+        JS_ReportError(cx, "Invalid quotas: expected an object");
+        return JS_FALSE;
+    }
+    JSObject * object = JSVAL_TO_OBJECT(options);
+    uint64_t resume_ms = quotas->resume_ms;
+    uint64_t fds = quotas->fds;
+    uint64_t pending = quotas->pending;
+    if (!read_quota(cx, object, "resume_ms", 0xffffffffULL, &resume_ms) ||
+        !read_quota(cx, object, "fds", 0x7fffffff, &fds) ||
+        !read_quota(cx, object, "pending", 0x7fffffff, &pending) ||
+        !read_quota(cx, object, "bytes_in", 1ULL << 62, &quotas->bytes_in) ||
+        !read_quota(cx, object, "bytes_out", 1ULL << 62, &quotas->bytes_out))
+        return JS_FALSE;
+    quotas->resume_ms = (uint32)resume_ms;
+    quotas->fds = (uint32)fds;
+    quotas->pending = (uint32)pending;
+    return JS_TRUE;
+}
+
+// address = spawn(filename, [priority], [deadline_ms], [quotas])
+// priority is "interactive", "normal" or "background"; the deadline is
+// in milliseconds from now. quotas is an object as for read_quotas, e.g.
+// {resume_ms: 2000, bytes_in: 0}. All default to the spawning actor's.
+// The child is compiled on the calling worker thread, so spawning never
+// has to wait on the main loop and the parent gets its Address directly.
+// The parent is sent cast('exit', [address.id, reason]) when the child dies.
 JSBool servo_spawn(JSContext *cx, uintN argc, jsval *vp) {
     JSString * data;
-    uint32 tag;
-    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "Su", &data, &tag);
+    jsval * argv = JS_ARGV(cx, vp);
+    int result = JS_ConvertArguments(cx, argc, argv, "S", &data);
     if (!result) {
-        JS_ReportError(cx, "Invalid arguments: expected filename, tag");
+        JS_ReportError(cx, "Invalid arguments: expected filename");
         return JS_FALSE;
     }
 
-    main_schedule_spawn(cx, data, tag);
+    int priority = -1;
+    if (argc > 1 && !JSVAL_IS_NULL(argv[1]) && !JSVAL_IS_VOID(argv[1])) {
+        JSString * name = JS_ValueToString(cx, argv[1]);
+        char * bytes = name ? JS_EncodeString(cx, name) : NULL;
+        if (!bytes)
+            return JS_FALSE;
+        for (int i = 0; i < NUM_PRIORITIES; i++) {
+            if (!strcmp(bytes, priority_names[i]))
+                priority = i;
+        }
+        if (priority < 0) {
+            JS_ReportError(cx, "Unknown priority %s", bytes);
+            JS_free(cx, bytes);
+            return JS_FALSE;
+        }
+        JS_free(cx, bytes);
+    }
+    uint64_t deadline = 0;
+    if (argc > 2 && !JSVAL_IS_NULL(argv[2]) && !JSVAL_IS_VOID(argv[2])) {
+        jsdouble ms;
+        if (!JS_ValueToNumber(cx, argv[2], &ms) || ms < 0) {
+            JS_ReportError(cx, "Invalid deadline");
+            return JS_FALSE;
+        }
+        deadline = now_usec(CLOCK_MONOTONIC) + (uint64_t)(ms * 1000);
+    }
+    Actor * actor = actor_of(cx);
+    Quotas quotas = actor->quotas;
+    if (argc > 3 && !JSVAL_IS_NULL(argv[3]) && !JSVAL_IS_VOID(argv[3])) {
+        if (!read_quotas(cx, argv[3], &quotas))
+            return JS_FALSE;
+    }
+
+    char * filename = JS_EncodeString(cx, data);
+    if (!filename)
+        return JS_FALSE;
+
+    // Compiling the child's scripts is not charged to our resume, so that
+    // e.g. a large Pool cannot trip our resume_ms on our behalf.
+    uint64_t spawn_started = now_usec(CLOCK_MONOTONIC);
+    JSContext * child = spawn(JS_GetRuntime(cx), filename, actor);
+    __sync_add_and_fetch(&actor->resume_excluded, now_usec(CLOCK_MONOTONIC) - spawn_started);
+    if (!child) {
+        JS_ReportError(cx, "Could not spawn %s", filename);
+        JS_free(cx, filename);
+        return JS_FALSE;
+    }
+    JS_free(cx, filename);
+
+    Actor * child_actor = actor_of(child);
+    if (priority >= 0)
+        child_actor->priority = priority;
+    if (deadline)
+        child_actor->deadline = deadline;
+    child_actor->quotas = quotas;
+
+    JSObject * address = new_address(cx, child_actor);
+    start_actor(child);
+    if (!address)
+        return JS_FALSE;
+
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(address));
     return JS_TRUE;
 }
 
-// This is only accessible as the return value of spawn.
+// This is only accessible through the Address objects returned by spawn
+// and bound to parent.
 JSBool servo_cast(JSContext *cx, uintN argc, jsval *vp) {
     JSString * pattern;
     JSString * data;
@@ -367,8 +1615,207 @@ JSBool servo_cast(JSContext *cx, uintN argc, jsval *vp) {
     }
 
     jsval callee = JS_CALLEE(cx, vp);
-    JSContext * other = (JSContext *)JS_GetPrivate(cx, JSVAL_TO_OBJECT(callee));
-    main_schedule_cast(other, pattern, data);
+    Actor * other = (Actor *)JS_GetPrivate(cx, JSVAL_TO_OBJECT(callee));
+    schedule_message(cx, other, pattern, data);
+    return JS_TRUE;
+}
+
+// [state, etag, last_modified] = cache_lookup(url, request_headers, request_id)
+// request_headers are the "Name: value\r\n" lines the request will send,
+// which responses that Vary on them are matched against. state is 'hit'
+// or 'wait' when the response will arrive as a 'cache' cast, or 'miss' or
+// 'stale' when the caller has to fetch it and then call cache_store or
+// cache_abandon. A stale entry comes with validators.
+JSBool servo_cache_lookup(JSContext *cx, uintN argc, jsval *vp) {
+    JSString * url;
+    JSString * headers;
+    uint32 tag;
+    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "SSu", &url, &headers, &tag);
+    if (!result) {
+        JS_ReportError(cx, "Invalid arguments: expected url, request_headers, request_id");
+        return JS_FALSE;
+    }
+    char * key = JS_EncodeString(cx, url);
+    if (!key)
+        return JS_FALSE;
+    char * request_headers = JS_EncodeString(cx, headers);
+    if (!request_headers) {
+        JS_free(cx, key);
+        return JS_FALSE;
+    }
+
+    Actor * actor = actor_of(cx);
+    CacheResponse response;
+    // Waiters keep a reference until cache_deliver.
+    __sync_add_and_fetch(&actor->refcount, 1);
+    int state = cache_lookup(key, request_headers, actor, tag, &response);
+    JS_free(cx, key);
+    JS_free(cx, request_headers);
+
+    const char * name;
+    if (state == CACHE_HIT) {
+        cache_deliver(actor, tag, response.data, response.length);
+        name = "hit";
+    } else if (state == CACHE_WAIT) {
+        name = "wait";
+    } else {
+        actor_release(actor);
+        name = state == CACHE_STALE ? "stale" : "miss";
+    }
+
+    JSObject * array = JS_NewArrayObject(cx, 0, NULL);
+    if (!array) {
+        cache_response_free(&response);
+        return JS_FALSE;
+    }
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(array));
+    jsval item = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, name));
+    JS_SetElement(cx, array, 0, &item);
+    item = response.etag ? STRING_TO_JSVAL(JS_NewStringCopyZ(cx, response.etag)) : JSVAL_NULL;
+    JS_SetElement(cx, array, 1, &item);
+    item = response.last_modified ?
+        STRING_TO_JSVAL(JS_NewStringCopyZ(cx, response.last_modified)) : JSVAL_NULL;
+    JS_SetElement(cx, array, 2, &item);
+    cache_response_free(&response);
+    return JS_TRUE;
+}
+
+// response = cache_store(url, request_headers, response)
+// request_headers are those passed to cache_lookup. Returns the response to use, which is the cached copy for a 304, or
+// null for a 304 whose copy has been evicted meanwhile. The caller then
+// fetches the url again without validators and stores that instead.
+JSBool servo_cache_store(JSContext *cx, uintN argc, jsval *vp) {
+    JSString * url;
+    JSString * headers;
+    JSString * data;
+    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "SSS", &url, &headers, &data);
+    if (!result) {
+        JS_ReportError(cx, "Invalid arguments: expected url, request_headers, response");
+        return JS_FALSE;
+    }
+    char * key = JS_EncodeString(cx, url);
+    if (!key)
+        return JS_FALSE;
+    char * request_headers = JS_EncodeString(cx, headers);
+    if (!request_headers) {
+        JS_free(cx, key);
+        return JS_FALSE;
+    }
+
+    size_t length = JS_GetStringEncodingLength(cx, data);
+    char * raw = (char *)malloc(length + 1);
+    JS_EncodeStringToBuffer(data, raw, length);
+
+    CacheResponse response;
+    cache_store(key, request_headers, raw, length, &response);
+    free(raw);
+    JS_free(cx, key);
+    JS_free(cx, request_headers);
+
+    if (!response.data) {
+        JS_SET_RVAL(cx, vp, JSVAL_NULL);
+        return JS_TRUE;
+    }
+    JSString * str = JS_NewStringCopyN(cx, response.data, response.length);
+    cache_response_free(&response);
+    if (!str)
+        return JS_FALSE;
+    JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(str));
+    return JS_TRUE;
+}
+
+// cache_abandon(url)
+JSBool servo_cache_abandon(JSContext *cx, uintN argc, jsval *vp) {
+    JSString * url;
+    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S", &url);
+    if (!result) {
+        JS_ReportError(cx, "Invalid arguments: expected url");
+        return JS_FALSE;
+    }
+    char * key = JS_EncodeString(cx, url);
+    if (!key)
+        return JS_FALSE;
+    cache_abandon(key);
+    JS_free(cx, key);
+    return JS_TRUE;
+}
+
+static void set_number_property(JSContext *cx, JSObject *obj, const char *name, jsdouble value) {
+    jsval v;
+    JS_NewNumberValue(cx, value, &v);
+    JS_SetProperty(cx, obj, name, &v);
+}
+
+// stats = actor_stats()
+JSBool servo_actor_stats(JSContext *cx, uintN argc, jsval *vp) {
+    Actor * actor = actor_of(cx);
+    JSObject * stats = JS_NewObject(cx, NULL, NULL, NULL);
+    if (!stats)
+        return JS_FALSE;
+
+    set_number_property(cx, stats, "resumes", (jsdouble)actor->resumes);
+    set_number_property(cx, stats, "cpu_ms", actor->cpu_usec / 1000.0);
+    set_number_property(cx, stats, "last_resume_ms", actor->last_resume_usec / 1000.0);
+    set_number_property(cx, stats, "bytes_in", (jsdouble)actor->bytes_in);
+    set_number_property(cx, stats, "bytes_out", (jsdouble)actor->bytes_out);
+    set_number_property(cx, stats, "tls_handshakes", (jsdouble)actor->tls_handshakes);
+    set_number_property(cx, stats, "tls_resumed", (jsdouble)actor->tls_resumed);
+    set_number_property(cx, stats, "gc_collections", (jsdouble)actor->gc_collections);
+    set_number_property(cx, stats, "gc_allocated", (jsdouble)actor->gc_allocated);
+    set_number_property(cx, stats, "fds", actor->nfds);
+    set_number_property(cx, stats, "pending", actor->pending);
+    set_number_property(cx, stats, "time_to_deadline_ms", actor->deadline ?
+        ((jsdouble)actor->deadline - (jsdouble)now_usec(CLOCK_MONOTONIC)) / 1000.0 : 0);
+    jsval priority = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, priority_names[actor->priority]));
+    JS_SetProperty(cx, stats, "priority", &priority);
+
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(stats));
+    return JS_TRUE;
+}
+
+// *** gc_collect()
+// Collect this actor's compartment once the current resume returns, e.g.
+// after it has let go of a finished page.
+JSBool servo_gc_collect(JSContext *cx, uintN argc, jsval *vp) {
+    actor_of(cx)->gc_requested = 1;
+    return JS_TRUE;
+}
+
+static int compare_pauses(const void * a, const void * b) {
+    uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+// stats = gc_stats()
+// Runtime-wide: collections by what started them, and pause times over
+// the latest GC_PAUSE_SAMPLES collections.
+JSBool servo_gc_stats(JSContext *cx, uintN argc, jsval *vp) {
+    uint64_t pauses[GC_PAUSE_SAMPLES];
+    uint64_t counts[NUM_GC_KINDS];
+    pthread_mutex_lock(&gc_mutex);
+    int npauses = gc_npauses < GC_PAUSE_SAMPLES ? gc_npauses : GC_PAUSE_SAMPLES;
+    memcpy(pauses, gc_pauses, npauses * sizeof(uint64_t));
+    memcpy(counts, gc_counts, sizeof(counts));
+    uint64_t total = gc_pause_total, max = gc_pause_max, last = gc_pause_last;
+    pthread_mutex_unlock(&gc_mutex);
+    qsort(pauses, npauses, sizeof(uint64_t), compare_pauses);
+
+    JSObject * stats = JS_NewObject(cx, NULL, NULL, NULL);
+    if (!stats)
+        return JS_FALSE;
+    set_number_property(cx, stats, "collections",
+        JS_GetGCParameter(JS_GetRuntime(cx), JSGC_NUMBER));
+    for (int kind = 0; kind < NUM_GC_KINDS; kind++)
+        set_number_property(cx, stats, gc_kind_names[kind], (jsdouble)counts[kind]);
+    set_number_property(cx, stats, "pause_total_ms", total / 1000.0);
+    set_number_property(cx, stats, "pause_max_ms", max / 1000.0);
+    set_number_property(cx, stats, "pause_last_ms", last / 1000.0);
+    set_number_property(cx, stats, "pause_p50_ms", npauses ? pauses[npauses / 2] / 1000.0 : 0);
+    set_number_property(cx, stats, "pause_p99_ms", npauses ? pauses[npauses * 99 / 100] / 1000.0 : 0);
+    set_number_property(cx, stats, "heap_bytes",
+        JS_GetGCParameter(JS_GetRuntime(cx), JSGC_BYTES));
+
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(stats));
     return JS_TRUE;
 }
 
@@ -397,11 +1844,17 @@ static JSClass global_class = {
     JSCLASS_NO_OPTIONAL_MEMBERS
 };
 
-static JSClass address_class = {
+static void address_finalize(JSContext *cx, JSObject *obj) {
+    Actor * actor = (Actor *)JS_GetPrivate(cx, obj);
+    if (actor)
+        actor_release(actor);
+}
+
+JSClass address_class = {
     "Address",
     JSCLASS_HAS_PRIVATE,
     JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
-    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, JS_FinalizeStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, address_finalize,
     NULL, NULL,
     servo_cast,
     NULL, NULL, NULL, NULL, NULL, NULL
@@ -420,29 +1873,123 @@ static JSBool servo_print(JSContext *cx, uintN argc, jsval *vp) {
     JSString *str;
     char *bytes;
 
-    argv = JS_ARGV(cx, vp);
-    for (i = 0; i < argc; i++) {
-        str = JS_ValueToString(cx, argv[i]);
-        if (!str)
-            return JS_FALSE;
-        bytes = JS_EncodeString(cx, str);
-        if (!bytes)
-            return JS_FALSE;
-        printf("%s%s", i ? " " : "", bytes);
-        JS_free(cx, bytes);
+    argv = JS_ARGV(cx, vp);
+    for (i = 0; i < argc; i++) {
+        str = JS_ValueToString(cx, argv[i]);
+        if (!str)
+            return JS_FALSE;
+        bytes = JS_EncodeString(cx, str);
+        if (!bytes)
+            return JS_FALSE;
+        printf("%s%s", i ? " " : "", bytes);
+        JS_free(cx, bytes);
+    }
+    printf("\n");
+    JS_SET_RVAL(cx, vp, JSVAL_VOID);
+    return JS_TRUE;
+}
+
+// Tokens are collected into one flat array, four slots per token:
+// type, value, then a tag's attributes as [name, value] pairs and its
+// self-closing flag, or a doctype's public and system ids. This is the
+// argument list of dom.js's insertToken.
+typedef struct _token_batch {
+    JSContext * cx;
+    JSObject * array;
+    jsuint length;
+} TokenBatch;
+
+static jsval html_string_value(JSContext * cx, HtmlString string) {
+    if (!string.chars)
+        return JSVAL_VOID;
+    JSString * str = JS_NewUCStringCopyN(cx, (const jschar *)string.chars, string.length);
+    return str ? STRING_TO_JSVAL(str) : JSVAL_NULL;
+}
+
+static int collect_token(void * closure, const HtmlToken * token) {
+    TokenBatch * batch = (TokenBatch *)closure;
+    JSContext * cx = batch->cx;
+    jsval slots[4];
+
+    slots[0] = INT_TO_JSVAL(token->type);
+    slots[1] = html_string_value(cx, token->value);
+    slots[2] = JSVAL_VOID;
+    slots[3] = JSVAL_VOID;
+    if (token->type == HTML_TAG) {
+        JSObject * attributes = JS_NewArrayObject(cx, 0, NULL);
+        if (!attributes)
+            return 1;
+        slots[2] = OBJECT_TO_JSVAL(attributes);
+        for (int i = 0; i < token->nattributes; i += 2) {
+            jsval pair[2];
+            pair[0] = html_string_value(cx, token->attributes[i]);
+            pair[1] = html_string_value(cx, token->attributes[i + 1]);
+            JSObject * pair_object = JS_NewArrayObject(cx, 2, pair);
+            if (!pair_object)
+                return 1;
+            jsval pairval = OBJECT_TO_JSVAL(pair_object);
+            if (!JS_SetElement(cx, attributes, i / 2, &pairval))
+                return 1;
+        }
+        slots[3] = BOOLEAN_TO_JSVAL(token->self_closing);
+    } else if (token->type == HTML_DOCTYPE) {
+        slots[2] = html_string_value(cx, token->public_id);
+        slots[3] = html_string_value(cx, token->system_id);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (!JS_SetElement(cx, batch->array, batch->length++, &slots[i]))
+            return 1;
+    }
+    return 0;
+}
+
+// tokens = html_tokenize(text)
+// Returns null if the document needs dom.js's own tokenizer.
+JSBool servo_html_tokenize(JSContext *cx, uintN argc, jsval *vp) {
+    JSString * text;
+    size_t length;
+
+    int result = JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S", &text);
+    if (!result) {
+        JS_ReportError(cx, "Invalid arguments to html_tokenize. Expected text");
+        return JS_FALSE;
+    }
+    const jschar * chars = JS_GetStringCharsAndLength(cx, text, &length);
+    if (!chars)
+        return JS_FALSE;
+
+    TokenBatch batch;
+    batch.cx = cx;
+    batch.length = 0;
+    batch.array = JS_NewArrayObject(cx, 0, NULL);
+    if (!batch.array)
+        return JS_FALSE;
+    // The return value slot keeps the array alive while it fills up.
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(batch.array));
+
+    result = html_tokenize((const HtmlChar *)chars, length, collect_token, &batch);
+    if (result == HTML_UNSUPPORTED) {
+        JS_SET_RVAL(cx, vp, JSVAL_NULL);
+        return JS_TRUE;
     }
-    printf("\n");
-    JS_SET_RVAL(cx, vp, JSVAL_VOID);
-    return JS_TRUE;
+    return result ? JS_FALSE : JS_TRUE;
 }
 
 static JSFunctionSpec servo_global_functions[] = {
     JS_FS("socket_connect",   servo_connect,   2, 0),
     JS_FS("socket_close", servo_close, 1, 0),
+    JS_FS("socket_cancel", servo_cancel, 1, 0),
     JS_FS("schedule_timer", servo_schedule_timer, 1, 0),
     JS_FS("schedule_read", servo_schedule_read, 1, 0),
     JS_FS("schedule_write", servo_schedule_write, 1, 0),
     JS_FS("spawn", servo_spawn, 1, 0),
+    JS_FS("actor_stats", servo_actor_stats, 0, 0),
+    JS_FS("gc_collect", servo_gc_collect, 0, 0),
+    JS_FS("gc_stats", servo_gc_stats, 0, 0),
+    JS_FS("cache_lookup", servo_cache_lookup, 3, 0),
+    JS_FS("cache_store", servo_cache_store, 3, 0),
+    JS_FS("cache_abandon", servo_cache_abandon, 1, 0),
+    JS_FS("html_tokenize", servo_html_tokenize, 1, 0),
     JS_FN("print", servo_print, 0, 0),
     JS_FS_END
 };
@@ -458,6 +2005,69 @@ JSTrapStatus SpewHook(JSContext *cx, JSScript *script, jsbytecode *pc, jsval *rv
 }
 #endif
 
+// Record the running script's stack for the profiler.
+static void sample_stack(JSContext *cx, Actor * actor) {
+    char * frames[PROFILE_MAX_FRAMES];
+    const char * stack[PROFILE_MAX_FRAMES];
+    int depth = 0;
+    JSStackFrame * iterator = NULL;
+    JSStackFrame * fp;
+
+    while (depth < PROFILE_MAX_FRAMES && (fp = JS_FrameIterator(cx, &iterator))) {
+        JSScript * script = JS_GetFrameScript(cx, fp);
+        if (!script)
+            continue;
+        JSFunction * fun = JS_GetFrameFunction(cx, fp);
+        JSString * id = fun ? JS_GetFunctionId(fun) : NULL;
+        char * name = id ? JS_EncodeString(cx, id) : NULL;
+        char frame[512];
+        snprintf(frame, sizeof(frame), "%s (%s:%u)",
+                 name ? name : (fun ? "(anonymous)" : "(top level)"),
+                 JS_GetScriptFilename(cx, script),
+                 JS_PCToLineNumber(cx, script, JS_GetFramePC(cx, fp)));
+        if (name)
+            JS_free(cx, name);
+        frames[depth++] = strdup(frame);
+    }
+    // The iterator starts at the innermost frame.
+    for (int i = 0; i < depth; i++)
+        stack[i] = frames[depth - 1 - i];
+    trace_sample(actor->id, stack, depth);
+    for (int i = 0; i < depth; i++)
+        free(frames[i]);
+}
+
+// How long the running actor's resume has been charged for, leaving out
+// time it spent spawning children. 0 when it is not running.
+static uint64_t resume_elapsed(Actor * actor, uint64_t now) {
+    uint64_t started = actor->resume_started;
+    if (!started || started > now)
+        return 0;
+    uint64_t elapsed = now - started;
+    uint64_t excluded = actor->resume_excluded;
+    return elapsed > excluded ? elapsed - excluded : 0;
+}
+
+// Triggered by the watchdog while an actor is running. Returning false
+// terminates the running script, which ends the actor.
+static JSBool operation_callback(JSContext *cx) {
+    Actor * actor = actor_of(cx);
+    if (!actor || !actor->resume_started)
+        return JS_TRUE;
+    if (actor->sample_requested) {
+        actor->sample_requested = 0;
+        sample_stack(cx, actor);
+    }
+    uint64_t elapsed = resume_elapsed(actor, now_usec(CLOCK_MONOTONIC));
+    uint64_t limit = (uint64_t)actor->quotas.resume_ms * 1000;
+    if (limit && elapsed > limit) {
+        printf("[%p] resume ran for %d ms, terminating\n", cx, (int)(elapsed / 1000));
+        actor->kill_reason = "cpu quota exceeded";
+        return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
 #pragma mark c actor management api
 
 // ****************************************************
@@ -477,13 +2087,12 @@ JSContext *make_context(JSRuntime *rt) {
     JS_SetOptions(cx, JSOPTION_VAROBJFIX | JSOPTION_JIT | JSOPTION_METHODJIT);
     JS_SetVersion(cx, JSVERSION_LATEST);
     JS_SetErrorReporter(cx, report_error);
+    JS_SetOperationCallback(cx, operation_callback);
 
     JSObject  *global = JS_NewCompartmentAndGlobalObject(cx, &global_class, NULL);
     if (global == NULL)
         return NULL;
 
-    JSObject *actors_array = JS_DefineObject(cx, global, "actors", NULL, NULL, 0);
-
     JS_SetGlobalObject(cx, global);
     if (!JS_InitStandardClasses(cx, global))
         return NULL;
@@ -496,14 +2105,40 @@ JSContext *make_context(JSRuntime *rt) {
     return cx;
 }
 
-JSContext *spawn(JSRuntime *rt, const char * filename) {
+// Undo a partially constructed actor. Called from inside its request.
+static JSContext *spawn_failed(JSContext *cx) {
+    JS_EndRequest(cx);
+    JS_ClearContextThread(cx);
+
+    Actor * actor = actor_of(cx);
+    pthread_mutex_lock(&actors_mutex);
+    JS_DestroyContextNoGC(cx);
+    actors_outstanding--;
+    printf("[%p] spawn failed (total %d)\n", cx, actors_outstanding);
+    pthread_mutex_unlock(&actors_mutex);
+    actor_release(actor);
+    return NULL;
+}
+
+// Safe to call from any thread, including a worker that is running the
+// parent actor; only the actor count is taken under actors_mutex so
+// concurrent spawns compile their scripts in parallel. The new actor
+// does not run until start_actor is called.
+JSContext *spawn(JSRuntime *rt, const char * filename, Actor * parent) {
     jsval rval;
     JSString *str;
     JSBool ok;
 
+    JSContext * cx = make_context(rt);
+    if (!cx)
+        return NULL;
+    Actor * actor = actor_new(cx, parent);
+    // make_context created the global's compartment on this thread.
+    actor->compartment = gc_new_compartment;
+    trace_instant("spawn", actor->id, filename);
+
     pthread_mutex_lock(&actors_mutex);
     actors_outstanding++;
-    JSContext * cx = make_context(rt);
     printf("[%p] spawn (total %d)\n", cx, actors_outstanding);
     pthread_mutex_unlock(&actors_mutex);
 
@@ -517,22 +2152,26 @@ JSContext *spawn(JSRuntime *rt, const char * filename) {
 
     FILE *the_file = fopen(filename, "r");
     if (!the_file)
-        return NULL;
+        return spawn_failed(cx);
     fseek(the_file, 0, SEEK_END);
     int file_size = ftell(the_file);
     rewind(the_file);
     char *file_data = (char*) calloc(sizeof(char), file_size + 17);
     fread(file_data, 1, file_size, the_file);
-    if(ferror(the_file))
-        return NULL;
+    if(ferror(the_file)) {
+        fclose(the_file);
+        free(file_data);
+        return spawn_failed(cx);
+    }
     fclose(the_file);
     memcpy(file_data + file_size, ";yield _sentinel;", 17);
 
     JSFunction * func = JS_CompileFunction(
         cx, global, "_main", 0, NULL, file_data, file_size + 17, filename, 0);
+    free(file_data);
     if (func == NULL) {
         printf("null func\n");
-        return NULL;
+        return spawn_failed(cx);
     }
 
     jsval window_object = OBJECT_TO_JSVAL(global);
@@ -540,248 +2179,558 @@ JSContext *spawn(JSRuntime *rt, const char * filename) {
 
     JSObject *navigator = JS_NewObject(cx, NULL, NULL, NULL);
     if (!navigator)
-        return NULL;
+        return spawn_failed(cx);
     jsval navigator_object = OBJECT_TO_JSVAL(navigator);
     JS_SetProperty(cx, global, "navigator", &navigator_object);
 
+    jsval parent_object = JSVAL_NULL;
+    if (parent) {
+        JSObject *parent_address = new_address(cx, parent);
+        if (!parent_address)
+            return spawn_failed(cx);
+        parent_object = OBJECT_TO_JSVAL(parent_address);
+    }
+    JS_SetProperty(cx, global, "parent", &parent_object);
+    jsval id_value = INT_TO_JSVAL(actor->id);
+    JS_SetProperty(cx, global, "actor_id", &id_value);
+
     JSScript *actormain = JS_CompileFile(cx, global, "actormain.js");
     if (!actormain)
-        return NULL;
+        return spawn_failed(cx);
 
     ok = JS_ExecuteScript(cx, global, actormain, &rval);
     if (!ok)
-        return NULL;
+        return spawn_failed(cx);
 
     JSScript *domjs = JS_CompileFile(cx, global, "deps/dom.js/dom.js");
     if (!domjs)
-        return NULL;
+        return spawn_failed(cx);
 
     ok = JS_ExecuteScript(cx, global, domjs, &rval);
     if (!ok)
-        return NULL;
+        return spawn_failed(cx);
 
     ok = JS_EvaluateScript(cx, global, "window.navigator.userAgent = 'servo 0.1a'", 41, "main", 0, &rval);
 
     JS_EndRequest(cx);
     JS_ClearContextThread(cx);
 
-    schedule_cast(cx, NULL, NULL, NULL);
     return cx;
 }
 
+// Queue the first resume of a freshly spawned actor.
+void start_actor(JSContext * cx) {
+    schedule_cast(cx, NULL, NULL, NULL);
+}
+
 #pragma mark main loop for js-running threads
 
-// Main actor dispatcher.
-void * thread_main(void * runtime_in) {
-    JSRuntime *rt = (JSRuntime *)runtime_in;
+// The actor each worker is running, so the watchdog can interrupt it.
+// Each slot has its own lock so workers never contend with each other.
+static Actor * running[NUM_THREADS];
+static pthread_mutex_t running_mutex[NUM_THREADS];
+
+// Wakes up every WATCHDOG_INTERVAL_MS and triggers the operation callback
+// of any actor whose current resume has overrun its slice.
+void * watchdog_main(void * unused) {
+    // When profiling the watchdog also wakes every running actor up
+    // to have its stack sampled.
+    uint64_t interval = WATCHDOG_INTERVAL_MS * 1000;
+    if (profile_interval_usec && profile_interval_usec < interval)
+        interval = profile_interval_usec;
+    trace_thread(NUM_THREADS + 1, "watchdog");
+
+    while (!shutting_down) {
+        usleep(interval);
+        uint64_t now = now_usec(CLOCK_MONOTONIC);
+        for (int i = 0; i < NUM_THREADS; i++) {
+            pthread_mutex_lock(&running_mutex[i]);
+            Actor * actor = running[i];
+            if (actor && actor->resume_started) {
+                uint64_t limit = (uint64_t)actor->quotas.resume_ms * 1000;
+                int overran = limit && resume_elapsed(actor, now) > limit;
+                if (profile_interval_usec)
+                    actor->sample_requested = 1;
+                if (overran || profile_interval_usec)
+                    JS_TriggerOperationCallback(actor->cx);
+            }
+            pthread_mutex_unlock(&running_mutex[i]);
+        }
+    }
+    return 0;
+}
 
+// Tell the actor a socket operation did not happen, with
+// cast('error', [fd, reason, request_id]). A timer has a null fd.
+static void dispatch_error(JSContext * runnable, jsval fdval, const char * reason, jsval * tag) {
+    JSObject * sandbox = JS_GetGlobalObject(runnable);
     jsval rval;
-    JSString *str;
-    JSBool ok;
+    jsval reasonval = STRING_TO_JSVAL(JS_NewStringCopyZ(runnable, reason));
+    jsval tagval = tag ? *tag : JSVAL_VOID;
+    JS_SetProperty(runnable, sandbox, "_fd", &fdval);
+    JS_SetProperty(runnable, sandbox, "_reason", &reasonval);
+    JS_SetProperty(runnable, sandbox, "_tag", &tagval);
+    const char * script = "cast('error', [_fd, _reason, _tag])";
+    if (!JS_EvaluateScript(runnable, sandbox, script, strlen(script), "main", 0, &rval)) {
+        printf("cast did not return ok?!\n");
+    }
+}
 
-    JSObject *sandbox;
-    JSContext *runnable;
-    Continuation *continuation;
+// The readiness a TLS result asks to wait for, or 0 if it is final.
+static int tls_want(ssize_t result) {
+    if (result == TLS_WANT_READ)
+        return EV_READ;
+    if (result == TLS_WANT_WRITE)
+        return EV_WRITE;
+    return 0;
+}
 
-    jsval * data;
-    jsval * tag;
-    jsval * cast;
-    uint32 intval;
+// Turn one continuation into a cast() into the actor's mailbox, doing
+// the send or recv it stands for first. Runs inside the actor's request.
+// Returns JS_TRUE if TLS needs the socket again first and the
+// continuation was armed again rather than used up.
+static JSBool dispatch_continuation(JSContext * runnable, Actor * actor, Continuation * continuation) {
+    JSObject * sandbox = JS_GetGlobalObject(runnable);
+    jsval rval;
+    JSBool ok = JS_TRUE;
 
-    while (1) {
-        if (shutting_down) {
-            return 0;
-        }
+    jsval * data = continuation->data;
+    jsval * tag = continuation->tag;
+    jsval * cast = continuation->cast;
+    uint32 intval = continuation->intval;
 
-        // ***************
-        // *** Locate Actor
-        pthread_mutex_lock(&runnables_mutex);
-        if (!runnables_outstanding) {
-            pthread_cond_wait(&runnables_condition, &runnables_mutex);
-            pthread_mutex_unlock(&runnables_mutex);
-            // Check to see if now shutting down.
-            continue;
+    if (continuation->error) {
+        // Timed out, cancelled or refused before the operation could go ahead.
+        if (data) {
+            JS_RemoveValueRoot(runnable, data);
+            free(data);
         }
-        continuation = runnables[--runnables_outstanding];
-
-        if (continuation->cx == NULL) {
-            printf("message sent to dead actor.\n");
-            pthread_mutex_unlock(&runnables_mutex);
-            continue;
+        dispatch_error(runnable, cast == cast_wait ? JSVAL_NULL : INT_TO_JSVAL(intval),
+                       continuation->error, tag);
+        if (tag) {
+            JS_RemoveValueRoot(runnable, tag);
+            free(tag);
         }
-        runnable = continuation->cx;
-        data = continuation->data;
-        tag = continuation->tag;
-        cast = continuation->cast;
-        intval = continuation->intval;
-
-        // ***************
-        // *** Reschedule
-        pthread_mutex_lock(&reschedule_mutex);
-        if (JS_GetContextThread(runnable)) {
-            Continuation * resched = (Continuation *)JS_GetContextPrivate(runnable);
-            while (resched->next) {
-                resched = resched->next;
+    } else if (cast == cast_connect) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(intval, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1)
+            error = errno;
+        const char * failure = error ? strerror(error) : NULL;
+        TlsConn * tls = actor_tls(actor, intval);
+        if (!failure && tls) {
+            int result = tls_handshake(tls);
+            if (tls_want(result)) {
+                rearm_continuation(continuation, tls_want(result));
+                return JS_TRUE;
             }
-            resched->next = continuation;
-            pthread_mutex_unlock(&reschedule_mutex);
-            pthread_mutex_unlock(&runnables_mutex);
-            continue;
-        }
-
-        JS_SetContextPrivate(runnable, (void *)continuation);
-        pthread_mutex_unlock(&reschedule_mutex);
-        // *** Reschedule
-        // ***************
-
-        JS_SetContextThread(runnable);
-        JS_BeginRequest(runnable);
-
-        pthread_mutex_unlock(&runnables_mutex);
-        // *** Locate Actor
-        // ***************
-
-        // *************************************************************
-        sandbox = JS_GetGlobalObject(runnable);
-
-        if (cast == cast_wait) {
-            if (tag) {
-                JS_SetProperty(runnable, sandbox, "_tag", tag);
-                int ok = JS_EvaluateScript(runnable, sandbox, "cast('wait', _tag)", 16, "main", 0, &rval);
+            if (result == TLS_ERROR) {
+                failure = tls_error(tls);
             } else {
-                int ok = JS_EvaluateScript(runnable, sandbox, "cast('wait')", 13, "main", 0, &rval);
+                actor->tls_handshakes++;
+                if (tls_resumed(tls))
+                    actor->tls_resumed++;
+                trace_instant("handshake", actor->id, tls_resumed(tls) ? "resumed" : "full");
             }
+        }
+        if (failure) {
+            dispatch_error(runnable, INT_TO_JSVAL(intval), failure, tag);
+        } else {
+            jsval fdval = INT_TO_JSVAL(intval);
+            JS_SetProperty(runnable, sandbox, "_fd", &fdval);
+            JS_SetProperty(runnable, sandbox, "_tag", tag);
+            ok = JS_EvaluateScript(runnable, sandbox, "cast('connect', [_fd, _tag])", 28, "main", 0, &rval);
             if (!ok) {
                 printf("cast did not return ok?!\n");
             }
-            if (tag) {
-                JS_RemoveValueRoot(runnable, tag);
-            }
-        } else if (cast == cast_send) {
+        }
+        JS_RemoveValueRoot(runnable, tag);
+        free(tag);
+    } else if (cast == cast_wait) {
+        if (tag) {
+            JS_SetProperty(runnable, sandbox, "_tag", tag);
+            int ok = JS_EvaluateScript(runnable, sandbox, "cast('wait', _tag)", 16, "main", 0, &rval);
+        } else {
+            int ok = JS_EvaluateScript(runnable, sandbox, "cast('wait')", 13, "main", 0, &rval);
+        }
+        if (!ok) {
+            printf("cast did not return ok?!\n");
+        }
+        if (tag) {
+            JS_RemoveValueRoot(runnable, tag);
+        }
+    } else if (cast == cast_send) {
+        ssize_t size_sent;
+        const char * failure = NULL;
+        if (continuation->buffer) {
+            // Already sent through the ring.
+            size_sent = continuation->result;
+            if (size_sent < 0)
+                failure = strerror(-size_sent);
+        } else {
             JSString *to_write_str = JSVAL_TO_STRING(*data);
             int size = JS_GetStringLength(to_write_str);
             char * to_write = JS_EncodeString(runnable, to_write_str);
-            JS_RemoveValueRoot(runnable, data);
-
-            int size_sent = send(intval, to_write, size, 0);
-            if (size_sent == -1) {
-                printf("Error writing to fd %d (%d)\n", intval, errno);
-            } else {
-                jsval *fd = (jsval *)malloc(sizeof(jsval));
-                JS_NewNumberValue(runnable, intval, fd);
-                JS_SetProperty(runnable, sandbox, "_fd", fd);
-                jsval *sent_js = (jsval *)malloc(sizeof(jsval));
-                JS_NewNumberValue(runnable, size_sent, sent_js);
-                JS_SetProperty(runnable,sandbox, "_sent", sent_js);
-                if (tag) {
-                    JS_SetProperty(runnable, sandbox, "_tag", tag);
-                    ok = JS_EvaluateScript(runnable, sandbox, "cast('send', [_fd, _sent, _tag])", 32, "main", 0, &rval);
-                    JS_RemoveValueRoot(runnable, tag);
-                } else {
-                    ok = JS_EvaluateScript(runnable, sandbox, "cast('send', [_fd, _sent])", 26, "main", 0, &rval);
-                }
-                if (!ok) {
-                    printf("cast did not return ok?!\n");
+            TlsConn * tls = actor_tls(actor, intval);
+            if (tls) {
+                size_sent = tls_write(tls, to_write, size);
+                if (tls_want(size_sent)) {
+                    JS_free(runnable, to_write);
+                    rearm_continuation(continuation, tls_want(size_sent));
+                    return JS_TRUE;
                 }
+                if (size_sent == TLS_ERROR)
+                    failure = tls_error(tls);
+            } else {
+                size_sent = send(intval, to_write, size, 0);
+                if (size_sent < 0)
+                    failure = strerror(errno);
             }
-        } else if (cast == cast_recv) {
-            int32 howmuch;
-            JS_ValueToInt32(runnable, *data, &howmuch);
+            JS_free(runnable, to_write);
             JS_RemoveValueRoot(runnable, data);
-
-            char * buffer = (char *)malloc(howmuch);
-            uint32 amountread = recv(intval, buffer, howmuch, 0);
-            buffer[amountread] = NULL;
-            jsval the_string = STRING_TO_JSVAL(JS_NewStringCopyN(runnable, buffer, amountread));
-
+        }
+        if (failure) {
+            dispatch_error(runnable, INT_TO_JSVAL(intval), failure, tag);
+            if (tag) {
+                JS_RemoveValueRoot(runnable, tag);
+            }
+        } else {
+            actor->bytes_out += size_sent;
             jsval *fd = (jsval *)malloc(sizeof(jsval));
             JS_NewNumberValue(runnable, intval, fd);
-
             JS_SetProperty(runnable, sandbox, "_fd", fd);
-            JS_SetProperty(runnable, sandbox, "_data", &the_string);
+            jsval *sent_js = (jsval *)malloc(sizeof(jsval));
+            JS_NewNumberValue(runnable, size_sent, sent_js);
+            JS_SetProperty(runnable,sandbox, "_sent", sent_js);
             if (tag) {
                 JS_SetProperty(runnable, sandbox, "_tag", tag);
-                ok = JS_EvaluateScript(runnable, sandbox, "cast('recv', [_fd, _data, _tag])", 32, "main", 0, &rval);
+                ok = JS_EvaluateScript(runnable, sandbox, "cast('send', [_fd, _sent, _tag])", 32, "main", 0, &rval);
                 JS_RemoveValueRoot(runnable, tag);
             } else {
-                ok = JS_EvaluateScript(runnable, sandbox, "cast('recv', [_fd, _data])", 26, "main", 0, &rval);
+                ok = JS_EvaluateScript(runnable, sandbox, "cast('send', [_fd, _sent])", 26, "main", 0, &rval);
             }
             if (!ok) {
                 printf("cast did not return ok?!\n");
             }
-        } else if (cast == cast_url) {
-            JS_SetProperty(runnable, sandbox, "_data", data);
-            int ok = JS_EvaluateScript(runnable, sandbox, "cast('url', _data)", 18, "main", 0, &rval);
-            if (!ok) {
-                printf("cast did not return ok?!\n");
-            }
-            JS_RemoveValueRoot(runnable, data);        
-        } else if (cast == cast_spawn) {
-            jsval actorsobj;
-            JS_GetProperty(runnable, sandbox, "actors", &actorsobj);
-            uint32 intval = JSVAL_TO_INT(*tag);
-            JSObject * objval = JSVAL_TO_OBJECT(actorsobj);
-            JS_SetElement(runnable, objval, intval, data);
+        }
+    } else if (cast == cast_recv) {
+        char * buffer;
+        ssize_t amountread;
+        const char * failure = NULL;
+        if (continuation->buffer) {
+            // Already received through the ring.
+            buffer = continuation->buffer;
+            amountread = continuation->result;
+            if (amountread < 0)
+                failure = strerror(-amountread);
+        } else {
+            int32 howmuch;
+            JS_ValueToInt32(runnable, *data, &howmuch);
 
-            JS_SetProperty(runnable, sandbox, "_tag", tag);
-            int ok = JS_EvaluateScript(runnable, sandbox, "cast('spawn', _tag)", 19, "main", 0, &rval);
-            if (!ok) {
-                printf("cast did not return ok?!\n");
+            buffer = (char *)malloc(howmuch + 1);
+            TlsConn * tls = actor_tls(actor, intval);
+            if (tls) {
+                amountread = tls_read(tls, buffer, howmuch);
+                if (tls_want(amountread)) {
+                    free(buffer);
+                    rearm_continuation(continuation, tls_want(amountread));
+                    return JS_TRUE;
+                }
+                if (amountread == TLS_ERROR)
+                    failure = tls_error(tls);
+            } else {
+                amountread = recv(intval, buffer, howmuch, 0);
+                if (amountread < 0)
+                    failure = strerror(errno);
             }
-            JS_RemoveValueRoot(runnable, tag);        
-        } else if (cast) {
-            JSString *newpat = JS_NewStringCopyN(
-                runnable, (char *)cast, strlen((char *)cast));
-            free((char *)cast);
-            JSString *newdata = JS_NewStringCopyN(
-                runnable, (char *)data, strlen((char *)data));
-            free((char *)data);
-
-            jsval patval = STRING_TO_JSVAL(newpat);
-            jsval datval = STRING_TO_JSVAL(newdata);
-            JS_SetProperty(runnable, sandbox, "_pattern", &patval);
-            JS_SetProperty(runnable, sandbox, "_data", &datval);
-            int ok = JS_EvaluateScript(runnable, sandbox, "cast(_pattern, _data)", 21, "main", 0, &rval);
-            if (!ok) {
-                printf("cast did not return ok?!\n");
+            JS_RemoveValueRoot(runnable, data);
+        }
+        if (failure) {
+            if (buffer != continuation->buffer)
+                free(buffer);
+            dispatch_error(runnable, INT_TO_JSVAL(intval), failure, tag);
+            if (tag) {
+                JS_RemoveValueRoot(runnable, tag);
             }
+            free(continuation->buffer);
+            return JS_FALSE;
+        }
+        buffer[amountread] = NULL;
+        actor->bytes_in += amountread;
+        jsval the_string = STRING_TO_JSVAL(JS_NewStringCopyN(runnable, buffer, amountread));
+        if (buffer != continuation->buffer)
+            free(buffer);
+
+        jsval *fd = (jsval *)malloc(sizeof(jsval));
+        JS_NewNumberValue(runnable, intval, fd);
+
+        JS_SetProperty(runnable, sandbox, "_fd", fd);
+        JS_SetProperty(runnable, sandbox, "_data", &the_string);
+        if (tag) {
+            JS_SetProperty(runnable, sandbox, "_tag", tag);
+            ok = JS_EvaluateScript(runnable, sandbox, "cast('recv', [_fd, _data, _tag])", 32, "main", 0, &rval);
+            JS_RemoveValueRoot(runnable, tag);
         } else {
-            //printf("something else...\n");
+            ok = JS_EvaluateScript(runnable, sandbox, "cast('recv', [_fd, _data])", 26, "main", 0, &rval);
         }
-
-        ok = JS_EvaluateScript(runnable, sandbox, "resume()", 8, "main", 0, &rval);
         if (!ok) {
-            printf("resume did not return ok?!\n");
+            printf("cast did not return ok?!\n");
+        }
+    } else if (cast == cast_url) {
+        JS_SetProperty(runnable, sandbox, "_data", data);
+        int ok = JS_EvaluateScript(runnable, sandbox, "cast('url', _data)", 18, "main", 0, &rval);
+        if (!ok) {
+            printf("cast did not return ok?!\n");
+        }
+        JS_RemoveValueRoot(runnable, data);        
+    } else if (cast == cast_exit) {
+        jsval idval = INT_TO_JSVAL(intval);
+        jsval reasonval = STRING_TO_JSVAL(JS_NewStringCopyZ(runnable, (char *)data));
+        free((char *)data);
+        JS_SetProperty(runnable, sandbox, "_id", &idval);
+        JS_SetProperty(runnable, sandbox, "_reason", &reasonval);
+        int ok = JS_EvaluateScript(runnable, sandbox, "cast('exit', [_id, _reason])", 28, "main", 0, &rval);
+        if (!ok) {
+            printf("cast did not return ok?!\n");
+        }
+    } else if (cast == cast_cache) {
+        jsval tagval = INT_TO_JSVAL(intval);
+        jsval the_string = STRING_TO_JSVAL(
+            JS_NewStringCopyN(runnable, (char *)data, continuation->length));
+        free((char *)data);
+        JS_SetProperty(runnable, sandbox, "_tag", &tagval);
+        JS_SetProperty(runnable, sandbox, "_data", &the_string);
+        int ok = JS_EvaluateScript(runnable, sandbox, "cast('cache', [_tag, _data])", 28, "main", 0, &rval);
+        if (!ok) {
+            printf("cast did not return ok?!\n");
+        }
+    } else if (cast) {
+        JSString *newpat = JS_NewStringCopyN(
+            runnable, (char *)cast, strlen((char *)cast));
+        free((char *)cast);
+        JSString *newdata = JS_NewStringCopyN(
+            runnable, (char *)data, strlen((char *)data));
+        free((char *)data);
+
+        jsval patval = STRING_TO_JSVAL(newpat);
+        jsval datval = STRING_TO_JSVAL(newdata);
+        JS_SetProperty(runnable, sandbox, "_pattern", &patval);
+        JS_SetProperty(runnable, sandbox, "_data", &datval);
+        int ok = JS_EvaluateScript(runnable, sandbox, "cast(_pattern, _data)", 21, "main", 0, &rval);
+        if (!ok) {
+            printf("cast did not return ok?!\n");
         }
+    } else {
+        //printf("something else...\n");
+    }
+    free(continuation->buffer);
+    return JS_FALSE;
+}
 
-        JS_EndRequest(runnable);
-        JS_ClearContextThread(runnable);
+// Main actor dispatcher.
+void * thread_main(void * index_in) {
+    int index = (int)(intptr_t)index_in;
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", index);
+    trace_thread(index + 1, thread_name);
+    JS_SetContextThread(gc_contexts[index]);
+
+    jsval rval;
+    JSString *str;
+    JSBool ok;
+
+    JSObject *sandbox;
+    JSContext *runnable;
+    Actor *actor;
+    Continuation *continuation;
 
-        pthread_mutex_lock(&reschedule_mutex);
-        if (continuation->next) {
-            schedule_actor(continuation->next);
+    while (1) {
+        if (shutting_down) {
+            return 0;
         }
-        pthread_mutex_unlock(&reschedule_mutex);
 
-        free(continuation);
+        // ***************
+        // *** Locate Actor
+        actor = run_queue_pop();
+        if (!actor) {
+            // Nothing to run: collect now rather than during a resume,
+            // then check to see if now shutting down.
+            gc_idle(index);
+            continue;
+        }
+        runnable = actor->cx;
+
+        // Take everything sent so far, oldest first.
+        Continuation * batch = (Continuation *)__sync_lock_test_and_set(&actor->mailbox, NULL);
+        Continuation * reversed = NULL;
+        int delivered = 0;
+        while (batch) {
+            Continuation * next = batch->next;
+            batch->next = reversed;
+            reversed = batch;
+            batch = next;
+            delivered++;
+        }
+        batch = reversed;
 
-        if (JSVAL_IS_NULL(rval)) {
-            // The Actor has finished, can destroy it's context.
-            pthread_mutex_lock(&actors_mutex);
-            JS_DestroyContext(runnable);
-            actors_outstanding--;
-            printf("[%p] actor dead (left %d)\n", runnable, actors_outstanding);
-            if (!actors_outstanding) {
-                pthread_cond_signal(&schedule_condition);
+        if (actor->dead) {
+            while (batch) {
+                Continuation * next = batch->next;
+                discard_continuation(batch);
+                batch = next;
             }
-            pthread_mutex_unlock(&actors_mutex);
+            actor_unschedule(actor);
+            actor_release_pending(actor, delivered);
+            continue;
+        }
+
+        JS_SetContextThread(runnable);
+        JS_BeginRequest(runnable);
+        // *** Locate Actor
+        // ***************
+
+        uint64_t cpu_started = now_usec(CLOCK_THREAD_CPUTIME_ID);
+        // Heap growth, counted against the actor's budget. Other workers
+        // allocate meanwhile, so this is an approximation.
+        uint32 heap_before = JS_GetGCParameter(gc_runtime, JSGC_BYTES);
+        pthread_mutex_lock(&running_mutex[index]);
+        actor->resume_excluded = 0;
+        actor->resume_started = now_usec(CLOCK_MONOTONIC);
+        running[index] = actor;
+        pthread_mutex_unlock(&running_mutex[index]);
+
+        // *************************************************************
+        sandbox = JS_GetGlobalObject(runnable);
+
+        // Deliver the whole batch, then resume once.
+        while (batch) {
+            continuation = batch;
+            batch = batch->next;
+            trace_begin("dispatch", actor->id, cast_name(continuation));
+            JSBool rearmed = dispatch_continuation(runnable, actor, continuation);
+            trace_end();
+            if (!rearmed)
+                free(continuation);
+        }
+
+        ok = JS_TRUE;
+        if (!actor->kill_reason) {
+            trace_begin("resume", actor->id, NULL);
+            ok = JS_EvaluateScript(runnable, sandbox, "resume()", 8, "main", 0, &rval);
+            trace_end();
+        }
+
+        pthread_mutex_lock(&running_mutex[index]);
+        actor->resume_started = 0;
+        actor->sample_requested = 0;
+        running[index] = NULL;
+        pthread_mutex_unlock(&running_mutex[index]);
+        actor->resumes++;
+        actor->last_resume_usec = now_usec(CLOCK_THREAD_CPUTIME_ID) - cpu_started;
+        actor->cpu_usec += actor->last_resume_usec;
+        uint32 heap_after = JS_GetGCParameter(gc_runtime, JSGC_BYTES);
+        if (heap_after > heap_before)
+            actor->gc_allocated += heap_after - heap_before;
+
+        // resume() returns null when the actor is finished, and leaves the
+        // reason in _exit_reason if it finished by throwing.
+        char * exit_reason = NULL;
+        if (actor->kill_reason) {
+            exit_reason = strdup(actor->kill_reason);
+        } else if (!ok) {
+            printf("resume did not return ok?!\n");
+            exit_reason = strdup("error");
+        } else if (JSVAL_IS_NULL(rval)) {
+            jsval reasonval;
+            char * bytes = NULL;
+            if (JS_GetProperty(runnable, sandbox, "_exit_reason", &reasonval) &&
+                JSVAL_IS_STRING(reasonval)) {
+                bytes = JS_EncodeString(runnable, JSVAL_TO_STRING(reasonval));
+            }
+            exit_reason = strdup(bytes ? bytes : "normal");
+            if (bytes)
+                JS_free(runnable, bytes);
+        }
+
+        JS_EndRequest(runnable);
+        if (!exit_reason)
+            gc_actor(actor);
+        JS_ClearContextThread(runnable);
+
+#ifdef USE_IO_URING
+        // One submission for all the I/O this resume asked for.
+        ring_flush();
+#endif
+
+        if (exit_reason) {
+            // The Actor has finished, its context is destroyed once
+            // nothing else is queued for it.
+            actor_exit(actor, exit_reason);
         }
+        actor_unschedule(actor);
+        actor_release_pending(actor, delivered);
         // *************************************************************
     }
 }
 
 #pragma mark main loop and libev loop
 
+#ifdef USE_IO_URING
+// The main thread's loop when I/O goes through the ring: hand each
+// completion to its actor's mailbox until every actor has finished.
+// Operations stopped by their linked timeout complete with -ECANCELED;
+// ones stopped by socket_cancel were already answered and are dropped.
+void ring_run() {
+    struct io_uring_cqe * cqe;
+    unsigned head;
+
+    while (1) {
+        pthread_mutex_lock(&actors_mutex);
+        if (!actors_outstanding) {
+            pthread_mutex_unlock(&actors_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&actors_mutex);
+
+        ring_flush();
+        int result = io_uring_wait_cqe(&ring, &cqe);
+        if (result < 0) {
+            if (result == -EINTR)
+                continue;
+            printf("io_uring_wait_cqe had an error %d\n", -result);
+            break;
+        }
+
+        int count = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            Continuation * cont = (Continuation *)io_uring_cqe_get_data(cqe);
+            if (cont && cont->cast != cast_wait) {
+                pthread_mutex_lock(&ring_mutex);
+                ring_untrack(cont);
+                int cancelled = cont->error == error_cancelled;
+                pthread_mutex_unlock(&ring_mutex);
+                if (cancelled) {
+                    Actor * actor = actor_of(cont->cx);
+                    discard_continuation(cont);
+                    actor_release_pending(actor, 1);
+                    cont = NULL;
+                } else if (cqe->res == -ECANCELED) {
+                    cont->error = error_timeout;
+                }
+            }
+            if (cont) {
+                cont->result = cqe->res;
+                trace_instant(cont->error ? "timeout" : "fire",
+                              actor_of(cont->cx)->id, cast_name(cont));
+                schedule_actor(cont);
+            }
+            count++;
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+}
+#endif
+
 // Main servo program.
 // Read urls from command line arguments, and start one
 // servo.js actor per url.
@@ -791,10 +2740,11 @@ void * thread_main(void * runtime_in) {
 int main(int argc, const char *argv[]) {
     int ok;
     pthread_t threads[NUM_THREADS];
-    struct ev_loop * loop = ev_default_loop(0); 
+    struct ev_loop * loop = ev_default_loop(0);
     JSRuntime *rt = JS_NewRuntime(RUNTIME_SIZE);
     if (rt == NULL)
         return 1;
+    gc_init(rt);
 
 #if DEBUG_SPEW
     JS_SetInterrupt(rt, &SpewHook, NULL);
@@ -806,7 +2756,10 @@ int main(int argc, const char *argv[]) {
     cast_send = (jsval *)malloc(sizeof(jsval));
     cast_recv = (jsval *)malloc(sizeof(jsval));
     cast_url = (jsval *)malloc(sizeof(jsval));
-    cast_spawn = (jsval *)malloc(sizeof(jsval));
+    cast_exit = (jsval *)malloc(sizeof(jsval));
+    cast_cache = (jsval *)malloc(sizeof(jsval));
+    cast_connect = (jsval *)malloc(sizeof(jsval));
+    cast_cancel = (jsval *)malloc(sizeof(jsval));
 
     JS_SetContextThread(cx);
     JS_BeginRequest(cx);
@@ -819,28 +2772,61 @@ int main(int argc, const char *argv[]) {
     ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'send'", 6, "main", 0, cast_send);
     ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'recv'", 6, "main", 0, cast_recv);
     ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'url'", 5, "main", 0, cast_url);
-    ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'spawn'", 7, "main", 0, cast_spawn);
+    ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'exit'", 6, "main", 0, cast_exit);
+    ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'cache'", 7, "main", 0, cast_cache);
+    ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'connect'", 9, "main", 0, cast_connect);
+    ok = JS_EvaluateScript(cx, JS_GetGlobalObject(cx), "'cancel'", 8, "main", 0, cast_cancel);
 
     JS_AddValueRoot(cx, cast_wait);
     JS_AddValueRoot(cx, cast_send);
     JS_AddValueRoot(cx, cast_recv);
     JS_AddValueRoot(cx, cast_url);
-    JS_AddValueRoot(cx, cast_spawn);
+    JS_AddValueRoot(cx, cast_exit);
+    JS_AddValueRoot(cx, cast_cache);
+    JS_AddValueRoot(cx, cast_connect);
+    JS_AddValueRoot(cx, cast_cancel);
+
+    cache_init(CACHE_DIRECTORY, CACHE_MEMORY_LIMIT, CACHE_DISK_LIMIT, cache_deliver);
+    if (!tls_init(getenv("SERVO_TLS_CA")))
+        printf("Could not set up TLS, https will not work\n");
+
+    trace_init(getenv("SERVO_TRACE"));
+    trace_thread(0, "main");
+    if (trace_enabled) {
+        const char * hz = getenv("SERVO_PROFILE_HZ");
+        int rate = hz ? atoi(hz) : PROFILE_DEFAULT_HZ;
+        if (rate > 0)
+            profile_interval_usec = 1000000 / rate;
+    }
+
+#ifdef USE_IO_URING
+    ok = io_uring_queue_init(RING_ENTRIES, &ring, 0);
+    if (ok < 0) {
+        printf("io_uring_queue_init had an error %d\n", -ok);
+        return 1;
+    }
+#else
+    main_loop = loop;
+    ev_async_init(&schedule_async, schedule_callback);
+    ev_async_start(loop, &schedule_async);
+#endif
 
     for (int i = 1; i < argc; i++) {
-        JSContext * new_actor = spawn(rt, "servo.js");
+        JSContext * new_actor = spawn(rt, "servo.js", NULL);
         if (!new_actor)
             return 1;
-        
+        start_actor(new_actor);
+
         jsval urlstr = STRING_TO_JSVAL(JS_NewStringCopyZ(new_actor, argv[i]));
         JS_AddValueRoot(cx, &urlstr);
         schedule_cast(new_actor, cast_url, &urlstr, NULL);
     }
     if (argc == 1) {
-        JSContext * new_actor = spawn(rt, "servo.js");
+        JSContext * new_actor = spawn(rt, "servo.js", NULL);
         if (!new_actor)
             return 1;
-        
+        start_actor(new_actor);
+
         jsval urlstr = STRING_TO_JSVAL(JS_NewStringCopyZ(new_actor, "http://localhost/"));
         JS_AddValueRoot(cx, &urlstr);
         schedule_cast(new_actor, cast_url, &urlstr, NULL);
@@ -849,77 +2835,31 @@ int main(int argc, const char *argv[]) {
     JS_ClearContextThread(cx);
 
     for (int i = 0; i < NUM_THREADS; i++) {
-        ok = pthread_create(&threads[i], NULL, thread_main, (void *)&rt);
+        pthread_mutex_init(&running_mutex[i], NULL);
+        ok = pthread_create(&threads[i], NULL, thread_main, (void *)(intptr_t)i);
         if (ok != 0) {
             printf("pthread_create had an error %d\n", ok);
         }
     }
-
-    while (1) {
-        pthread_mutex_lock(&schedule_mutex);
-        if (!schedule_outstanding) {
-            pthread_cond_wait(&schedule_condition, &schedule_mutex);
-        }
-        while (schedule_outstanding) {
-            Continuation *to_schedule = schedule[--schedule_outstanding];
-            if (to_schedule->cast == cast_wait) {
-                ev_timer *timer = (ev_timer *)malloc(sizeof(ev_timer));
-                ev_timer_init(timer, timer_callback, to_schedule->intval / 1000.0, 0.);
-                timer->data = (void *)to_schedule;
-                ev_timer_start(loop, timer);
-            } else if (to_schedule->cast == cast_send) {
-                ev_io *io = (ev_io *)malloc(sizeof(ev_io));
-                ev_io_init(io, io_callback, to_schedule->intval, EV_WRITE);
-                io->data = (void *)to_schedule;
-                ev_io_start(loop, io);
-            } else if (to_schedule->cast == cast_recv) {
-                ev_io *io = (ev_io *)malloc(sizeof(ev_io));
-                ev_io_init(io, io_callback, to_schedule->intval, EV_READ);
-                io->data = (void *)to_schedule;
-                ev_io_start(loop, io);
-            } else if (to_schedule->cast == cast_spawn) {
-                JS_SetContextThread(cx);
-                JS_BeginRequest(cx);
-
-                JSContext * new_context = spawn(
-                    rt, (const char *)to_schedule->data);
-
-                jsval * tagval = (jsval *)JS_malloc(to_schedule->cx, sizeof(jsval));
-                JS_NewNumberValue(to_schedule->cx, to_schedule->intval, tagval);
-                JS_AddValueRoot(to_schedule->cx, tagval);
-                JSObject * addr_instance = JS_NewObject(
-                    cx, &address_class, NULL, NULL);
-                JS_SetPrivate(cx, addr_instance, new_context);
-
-                jsval * addr_jsval = (jsval *)malloc(sizeof(jsval));
-                *addr_jsval = OBJECT_TO_JSVAL(addr_instance);
-                schedule_cast(to_schedule->cx, cast_spawn, addr_jsval, tagval);
-                //schedule_actor(new_context);
-                
-                //JS_DefineObject(cx, 
-
-                JS_EndRequest(cx);
-                JS_ClearContextThread(cx);
-                continue;
-            } else {
-                schedule_actor(to_schedule);
-                continue;
-            }
-        }
-        pthread_mutex_unlock(&schedule_mutex);
-
-        pthread_mutex_lock(&actors_mutex);
-        if (!actors_outstanding) {
-            pthread_mutex_unlock(&actors_mutex);
-            break;
-        }
-        pthread_mutex_unlock(&actors_mutex);
-        
-        ev_run(loop, 0);
+    // Any actor may be spawned with a resume_ms, so the watchdog always runs.
+    pthread_t watchdog;
+    ok = pthread_create(&watchdog, NULL, watchdog_main, NULL);
+    if (ok != 0) {
+        printf("pthread_create had an error %d\n", ok);
     }
 
+#ifdef USE_IO_URING
+    ring_run();
+#else
+    // schedule_callback stops the loop once every actor has finished. Run
+    // it once for whatever the workers scheduled before the loop started.
+    ev_async_send(loop, &schedule_async);
+    ev_run(loop, 0);
+#endif
+
     shutting_down = 1;
     pthread_cond_broadcast(&runnables_condition);
+    trace_finish();
 
     /* Clean things up and shut down SpiderMonkey. */
     JS_DestroyRuntime(rt);
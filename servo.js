@@ -54,8 +54,11 @@ let xhr = new XMLHttpRequest();
 
 xhr.onreadystatechange = function() {
     if (this.readyState === 4) {
-        var newdoc = document.implementation.mozHTMLParser(mutation).end(this.responseText);
+        var newdoc = parseHTML(document.implementation.mozHTMLParser(mutation), this.responseText);
         print(newdoc);
+        print("parseHTML", JSON.stringify(parseHTML.stats));
+        // The page is done; collect its garbage before the next one.
+        gc_collect();
         //window.parseHtmlDocument(this.responseText, document, cb, null);
     }
 }
@@ -63,9 +66,7 @@ xhr.onreadystatechange = function() {
 let url = yield receive("url");
 print("Loading", url);
 
-spawn('foo.js', 1);
-let res = yield receive('spawn');
-let address = actors[res];
+let address = spawn('foo.js');
 address('foo', "what's happenin!");
 
 xhr.open("GET", url);
@@ -0,0 +1,256 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+#define SESSION_BUCKETS 1024
+// TLS 1.3 tickets are used once each; servers usually send two.
+#define SESSIONS_PER_PEER 4
+
+#pragma mark tls state
+
+// Resumable sessions for one host:port, newest last.
+typedef struct _session_entry {
+    char * peer;
+    SSL_SESSION * sessions[SESSIONS_PER_PEER];
+    int nsessions;
+    struct _session_entry * hash_next;
+} SessionEntry;
+
+struct _tls_conn {
+    SSL * ssl;
+    char * peer;             // host:port, the session cache key
+    int failed;              // the session must not be resumed
+    char error[256];
+};
+
+static SSL_CTX * tls_context = NULL;
+static int peer_index = -1;  // SSL ex_data slot holding the TlsConn
+
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SessionEntry * session_buckets[SESSION_BUCKETS];
+
+static SessionEntry ** session_bucket(const char * peer) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char * p = (const unsigned char *)peer; *p; p++)
+        hash = (hash ^ *p) * 1099511628211ULL;
+    return &session_buckets[hash % SESSION_BUCKETS];
+}
+
+// Called with sessions_mutex held.
+static SessionEntry * session_entry(const char * peer, int create) {
+    SessionEntry ** bucket = session_bucket(peer);
+    for (SessionEntry * entry = *bucket; entry; entry = entry->hash_next) {
+        if (!strcmp(entry->peer, peer))
+            return entry;
+    }
+    if (!create)
+        return NULL;
+    SessionEntry * entry = (SessionEntry *)calloc(1, sizeof(SessionEntry));
+    entry->peer = strdup(peer);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+#pragma mark session cache
+
+// OpenSSL hands us each new session: after a TLS 1.2 handshake, or
+// whenever a TLS 1.3 server sends a ticket. Returning 1 keeps the
+// reference.
+static int session_new(SSL * ssl, SSL_SESSION * session) {
+    TlsConn * conn = (TlsConn *)SSL_get_ex_data(ssl, peer_index);
+    if (!conn || !SSL_SESSION_is_resumable(session))
+        return 0;
+
+    pthread_mutex_lock(&sessions_mutex);
+    SessionEntry * entry = session_entry(conn->peer, 1);
+    if (entry->nsessions == SESSIONS_PER_PEER) {
+        SSL_SESSION_free(entry->sessions[0]);
+        memmove(entry->sessions, entry->sessions + 1,
+                (SESSIONS_PER_PEER - 1) * sizeof(SSL_SESSION *));
+        entry->nsessions--;
+    }
+    entry->sessions[entry->nsessions++] = session;
+    pthread_mutex_unlock(&sessions_mutex);
+    return 1;
+}
+
+// A session to resume with, or NULL. TLS 1.3 tickets are taken out of
+// the cache so that each is used once; older sessions stay shared.
+static SSL_SESSION * session_take(const char * peer) {
+    SSL_SESSION * session = NULL;
+    pthread_mutex_lock(&sessions_mutex);
+    SessionEntry * entry = session_entry(peer, 0);
+    while (entry && entry->nsessions && !session) {
+        session = entry->sessions[entry->nsessions - 1];
+        if (!SSL_SESSION_is_resumable(session)) {
+            SSL_SESSION_free(session);
+            session = NULL;
+            entry->nsessions--;
+        } else if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION) {
+            entry->nsessions--;
+        } else {
+            SSL_SESSION_up_ref(session);
+        }
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return session;
+}
+
+#pragma mark connections
+
+int tls_init(const char * ca_file) {
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if (!tls_context)
+        return 0;
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(tls_context);
+    if (ca_file && !SSL_CTX_load_verify_locations(tls_context, ca_file, NULL))
+        printf("Could not load TLS certificates from %s\n", ca_file);
+
+    // Writes are retried with a freshly encoded copy of the same string.
+    SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // Plenty of HTTP/1.0 servers close without a close_notify.
+    SSL_CTX_set_options(tls_context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    // Sessions are cached here, by peer, rather than by OpenSSL's
+    // internal cache, which a client cannot look up by host.
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_context, session_new);
+    peer_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    return 1;
+}
+
+TlsConn * tls_new(int fd, const char * host, int port) {
+    if (!tls_context)
+        return NULL;
+    SSL * ssl = SSL_new(tls_context);
+    if (!ssl)
+        return NULL;
+    TlsConn * conn = (TlsConn *)calloc(1, sizeof(TlsConn));
+    conn->ssl = ssl;
+    conn->peer = (char *)malloc(strlen(host) + 16);
+    sprintf(conn->peer, "%s:%d", host, port);
+
+    SSL_set_fd(ssl, fd);
+    SSL_set_ex_data(ssl, peer_index, conn);
+    SSL_set_tlsext_host_name(ssl, host);
+    SSL_set1_host(ssl, host);
+    SSL_SESSION * session = session_take(conn->peer);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+    SSL_set_connect_state(ssl);
+    return conn;
+}
+
+void tls_free(TlsConn * conn) {
+    if (!conn)
+        return;
+    // OpenSSL drops the session of a connection freed without a shutdown.
+    // Mark a healthy one shut down, without writing to a socket the peer
+    // may already have closed.
+    if (!conn->failed && SSL_is_init_finished(conn->ssl)) {
+        SSL_set_quiet_shutdown(conn->ssl, 1);
+        SSL_shutdown(conn->ssl);
+    }
+    SSL_free(conn->ssl);
+    free(conn->peer);
+    free(conn);
+}
+
+// Sort out the result of an SSL call that did not succeed.
+static int tls_result(TlsConn * conn, int result) {
+    int error = SSL_get_error(conn->ssl, result);
+    switch (error) {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    }
+
+    long verify = SSL_get_verify_result(conn->ssl);
+    unsigned long queued = ERR_peek_last_error();
+    if (verify != X509_V_OK) {
+        snprintf(conn->error, sizeof(conn->error), "certificate: %s",
+                 X509_verify_cert_error_string(verify));
+    } else if (queued) {
+        ERR_error_string_n(queued, conn->error, sizeof(conn->error));
+    } else if (error == SSL_ERROR_SYSCALL && errno) {
+        snprintf(conn->error, sizeof(conn->error), "%s", strerror(errno));
+    } else {
+        snprintf(conn->error, sizeof(conn->error), "connection closed");
+    }
+    ERR_clear_error();
+    conn->failed = 1;
+    return TLS_ERROR;
+}
+
+int tls_handshake(TlsConn * conn) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(conn->ssl);
+    if (result == 1)
+        return TLS_OK;
+    result = tls_result(conn, result);
+    // A handshake cut short is an error, not an end of stream.
+    if (result == 0) {
+        snprintf(conn->error, sizeof(conn->error), "connection closed");
+        conn->failed = 1;
+        return TLS_ERROR;
+    }
+    return result;
+}
+
+int tls_resumed(TlsConn * conn) {
+    return SSL_session_reused(conn->ssl);
+}
+
+ssize_t tls_read(TlsConn * conn, char * buffer, size_t length) {
+    ERR_clear_error();
+    int result = SSL_read(conn->ssl, buffer, length);
+    if (result > 0)
+        return result;
+    return tls_result(conn, result);
+}
+
+ssize_t tls_write(TlsConn * conn, const char * buffer, size_t length) {
+    if (!length)
+        return 0;
+    ERR_clear_error();
+    int result = SSL_write(conn->ssl, buffer, length);
+    if (result > 0)
+        return result;
+    result = tls_result(conn, result);
+    if (result == 0) {
+        snprintf(conn->error, sizeof(conn->error), "connection closed");
+        conn->failed = 1;
+        return TLS_ERROR;
+    }
+    return result;
+}
+
+int tls_pending(TlsConn * conn) {
+    return SSL_pending(conn->ssl);
+}
+
+const char * tls_error(TlsConn * conn) {
+    return conn->error;
+}
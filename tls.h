@@ -0,0 +1,56 @@
+#ifndef SERVO_TLS_H
+#define SERVO_TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// ****************************************************
+// TLS client connections over non-blocking sockets, using OpenSSL.
+// Every call either makes progress or says which readiness the socket
+// needs before it is retried, so the event loop drives the handshake
+// and the record layer. Sessions and TLS 1.3 tickets are kept in one
+// runtime-wide cache by host and port, so later connections to a host
+// resume instead of doing a full handshake.
+// ****************************************************
+
+typedef struct _tls_conn TlsConn;
+
+// Results besides byte counts. Retry the same call once the socket is
+// readable or writable. None is -1, so none can be mistaken for a failed
+// send() or recv().
+#define TLS_OK 0
+#define TLS_WANT_READ -2
+#define TLS_WANT_WRITE -3
+#define TLS_ERROR -4
+
+// Trust ca_file (may be NULL) on top of the system's certificates, e.g.
+// to test against a server with a self-signed certificate. Returns 0 if
+// TLS is unavailable.
+int tls_init(const char * ca_file);
+
+// Start a client connection on a connected socket. The certificate must
+// be valid for host; a session cached for host:port is resumed.
+TlsConn * tls_new(int fd, const char * host, int port);
+
+void tls_free(TlsConn * conn);
+
+// TLS_OK once the handshake is done.
+int tls_handshake(TlsConn * conn);
+
+// 1 if the finished handshake resumed a cached session.
+int tls_resumed(TlsConn * conn);
+
+// Bytes read, 0 when the peer has closed, or one of the results above.
+ssize_t tls_read(TlsConn * conn, char * buffer, size_t length);
+
+// Bytes written, or one of the results above. A retry may pass a copy of
+// the same bytes at another address.
+ssize_t tls_write(TlsConn * conn, const char * buffer, size_t length);
+
+// Decrypted bytes a read can return without waiting for the socket.
+int tls_pending(TlsConn * conn);
+
+// Why the last call returned TLS_ERROR.
+const char * tls_error(TlsConn * conn);
+
+#endif
@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define FRAME_BUCKETS 4096
+
+#pragma mark trace state
+
+// Stack frames are interned by name and parent, so a sample is a
+// single id naming its innermost frame.
+typedef struct _frame {
+    char * name;
+    int id;
+    int parent;              // -1 for an outermost frame
+    struct _frame * hash_next;
+} Frame;
+
+int trace_enabled = 0;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE * trace_file = NULL;
+static uint64_t trace_start = 0;
+static int events_written = 0;
+static __thread int trace_tid = 0;
+
+static Frame ** frames = NULL;
+static int nframes = 0;
+static int frames_capacity = 0;
+static Frame * frame_buckets[FRAME_BUCKETS];
+
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - trace_start;
+}
+
+static void write_string(const char * string) {
+    fputc('"', trace_file);
+    for (const unsigned char * p = (const unsigned char *)string; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(trace_file, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(trace_file, "\\u%04x", *p);
+        else
+            fputc(*p, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+// Start an event; called with trace_mutex held and the file open.
+static void event_start(char phase, const char * name) {
+    fprintf(trace_file, "%s\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%llu",
+            events_written++ ? "," : "", phase, trace_tid,
+            (unsigned long long)trace_now());
+    if (name) {
+        fprintf(trace_file, ",\"name\":");
+        write_string(name);
+    }
+}
+
+static void event_args(uint32_t actor, const char * detail) {
+    fprintf(trace_file, ",\"args\":{\"actor\":%u", actor);
+    if (detail) {
+        fprintf(trace_file, ",\"detail\":");
+        write_string(detail);
+    }
+    fprintf(trace_file, "}");
+}
+
+#pragma mark recording
+
+void trace_init(const char * path) {
+    if (!path)
+        return;
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        printf("Could not open trace file %s\n", path);
+        return;
+    }
+    trace_start = 0;
+    trace_start = trace_now();
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace_enabled = 1;
+}
+
+void trace_thread(int tid, const char * name) {
+    trace_tid = tid;
+    if (!trace_enabled)
+        return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        event_start('M', "thread_name");
+        fprintf(trace_file, ",\"args\":{\"name\":");
+        write_string(name);
+        fprintf(trace_file, "}}");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_instant(const char * name, uint32_t actor, const char * detail) {
+    if (!trace_enabled)
+        return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        event_start('i', name);
+        fprintf(trace_file, ",\"s\":\"t\"");
+        event_args(actor, detail);
+        fprintf(trace_file, "}");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_begin(const char * name, uint32_t actor, const char * detail) {
+    if (!trace_enabled)
+        return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        event_start('B', name);
+        event_args(actor, detail);
+        fprintf(trace_file, "}");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_end() {
+    if (!trace_enabled)
+        return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        event_start('E', NULL);
+        fprintf(trace_file, "}");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Called with trace_mutex held.
+static int intern_frame(const char * name, int parent) {
+    uint64_t hash = 14695981039346656037ULL ^ (uint64_t)(parent + 1);
+    for (const unsigned char * p = (const unsigned char *)name; *p; p++)
+        hash = (hash ^ *p) * 1099511628211ULL;
+    Frame ** bucket = &frame_buckets[hash % FRAME_BUCKETS];
+    for (Frame * frame = *bucket; frame; frame = frame->hash_next) {
+        if (frame->parent == parent && !strcmp(frame->name, name))
+            return frame->id;
+    }
+
+    if (nframes == frames_capacity) {
+        frames_capacity = frames_capacity * 2 + 256;
+        frames = (Frame **)realloc(frames, frames_capacity * sizeof(Frame *));
+    }
+    Frame * frame = (Frame *)malloc(sizeof(Frame));
+    frame->name = strdup(name);
+    frame->parent = parent;
+    frame->id = nframes;
+    frame->hash_next = *bucket;
+    *bucket = frame;
+    frames[nframes++] = frame;
+    return frame->id;
+}
+
+void trace_sample(uint32_t actor, const char ** stack, int depth) {
+    if (!trace_enabled || !depth)
+        return;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        int id = -1;
+        for (int i = 0; i < depth; i++)
+            id = intern_frame(stack[i], id);
+        event_start('P', "sample");
+        fprintf(trace_file, ",\"sf\":%d", id);
+        event_args(actor, NULL);
+        fprintf(trace_file, "}");
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_finish() {
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file) {
+        fprintf(trace_file, "\n],\n\"stackFrames\":{");
+        for (int i = 0; i < nframes; i++) {
+            fprintf(trace_file, "%s\n\"%d\":{\"name\":", i ? "," : "", i);
+            write_string(frames[i]->name);
+            if (frames[i]->parent >= 0)
+                fprintf(trace_file, ",\"parent\":\"%d\"", frames[i]->parent);
+            fprintf(trace_file, "}");
+        }
+        fprintf(trace_file, "\n}}\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    trace_enabled = 0;
+    pthread_mutex_unlock(&trace_mutex);
+}
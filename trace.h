@@ -0,0 +1,33 @@
+#ifndef SERVO_TRACE_H
+#define SERVO_TRACE_H
+
+#include <stdint.h>
+
+// ****************************************************
+// Opt-in timeline of scheduler events and sampled JS stacks, written
+// as Chrome trace-event JSON for chrome://tracing or ui.perfetto.dev.
+// Every thread gets its own track; events carry the actor id. Nothing
+// is recorded unless trace_init was given a path.
+// ****************************************************
+
+extern int trace_enabled;
+
+void trace_init(const char * path);
+
+// Write out the stack frames and close the file. Later events are dropped.
+void trace_finish();
+
+// Name the calling thread's track.
+void trace_thread(int tid, const char * name);
+
+// A point in time, e.g. a message posted or a watcher armed.
+void trace_instant(const char * name, uint32_t actor, const char * detail);
+
+// A span on the calling thread's track; spans nest.
+void trace_begin(const char * name, uint32_t actor, const char * detail);
+void trace_end();
+
+// A JS stack, outermost frame first.
+void trace_sample(uint32_t actor, const char ** frames, int nframes);
+
+#endif
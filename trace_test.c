@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// ****************************************************
+// Standalone checks for trace.c, run by make check. A trace is
+// recorded to a temporary file, read back and checked piecewise;
+// timestamps vary from run to run, so they are never compared.
+// ****************************************************
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+static char * read_file(const char * path) {
+    FILE * file = fopen(path, "r");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char * text = (char *)malloc(length + 1);
+    text[fread(text, 1, length, file)] = 0;
+    fclose(file);
+    return text;
+}
+
+static int count(const char * text, const char * needle) {
+    int n = 0;
+    for (const char * p = text; (p = strstr(p, needle)); p += strlen(needle))
+        n++;
+    return n;
+}
+
+// Brackets and braces outside strings must balance and never go negative.
+static int balanced(const char * text) {
+    int depth = 0, in_string = 0;
+    for (const char * p = text; *p; p++) {
+        if (in_string) {
+            if (*p == '\\' && p[1])
+                p++;
+            else if (*p == '"')
+                in_string = 0;
+        } else if (*p == '"') {
+            in_string = 1;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if ((*p == '}' || *p == ']') && --depth < 0) {
+            return 0;
+        }
+    }
+    return !depth && !in_string;
+}
+
+static void * worker(void * arg) {
+    trace_thread((int)(long)arg, "worker");
+    for (int i = 0; i < 100; i++) {
+        trace_begin("resume", (uint32_t)(long)arg, NULL);
+        trace_end();
+    }
+    return NULL;
+}
+
+int main() {
+    char path[] = "/tmp/servo-trace-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    // Nothing is recorded before trace_init, or when it gets no path.
+    trace_instant("early", 1, NULL);
+    trace_init(NULL);
+    CHECK(!trace_enabled);
+
+    trace_init(path);
+    CHECK(trace_enabled);
+    trace_thread(0, "main \"thread\"");
+    trace_instant("posted", 7, "a\"b\\c\nd");
+    trace_begin("resume", 7, "outer");
+    trace_begin("callback", 7, NULL);
+    trace_end();
+    trace_end();
+
+    // Samples sharing a prefix share its frames; g under f and g under
+    // main are different frames.
+    const char * first[] = { "main", "f", "g" };
+    const char * second[] = { "main", "f", "h" };
+    const char * third[] = { "main", "g" };
+    trace_sample(7, first, 3);
+    trace_sample(7, second, 3);
+    trace_sample(7, third, 2);
+    trace_sample(7, first, 3);
+    trace_sample(7, first, 0);
+
+    pthread_t threads[4];
+    for (long i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(i + 1));
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    trace_finish();
+    CHECK(!trace_enabled);
+    char * text = read_file(path);
+    CHECK(text != NULL);
+    if (text) {
+        trace_instant("late", 1, NULL);
+        trace_finish();
+        char * after = read_file(path);
+        CHECK(after && !strcmp(text, after));
+        free(after);
+
+        CHECK(!strncmp(text, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 39));
+        CHECK(balanced(text));
+        CHECK(!strstr(text, "early") && !strstr(text, "late"));
+
+        // Thread names, instants with escaped details, nested spans.
+        CHECK(count(text, "\"ph\":\"M\"") == 5);
+        CHECK(strstr(text, "\"args\":{\"name\":\"main \\\"thread\\\"\"}"));
+        CHECK(strstr(text, "\"ph\":\"i\",\"pid\":1,\"tid\":0,"));
+        CHECK(strstr(text, "\"name\":\"posted\",\"s\":\"t\",\"args\":{\"actor\":7,"
+                           "\"detail\":\"a\\\"b\\\\c\\u000ad\"}}"));
+        CHECK(strstr(text, "\"name\":\"resume\",\"args\":{\"actor\":7,\"detail\":\"outer\"}}"));
+        CHECK(strstr(text, "\"name\":\"callback\",\"args\":{\"actor\":7}}"));
+        CHECK(count(text, "\"ph\":\"B\"") == 402);
+        CHECK(count(text, "\"ph\":\"E\"") == 402);
+        for (int tid = 1; tid <= 4; tid++) {
+            char needle[64];
+            snprintf(needle, sizeof(needle), "\"ph\":\"B\",\"pid\":1,\"tid\":%d,", tid);
+            CHECK(count(text, needle) == 100);
+        }
+
+        // Samples name their innermost frame; frames are written once each.
+        CHECK(count(text, "\"ph\":\"P\"") == 4);
+        CHECK(count(text, "\"sf\":2,") == 2);
+        CHECK(count(text, "\"sf\":3,") == 1);
+        CHECK(count(text, "\"sf\":4,") == 1);
+        CHECK(strstr(text, "\"stackFrames\":{\n"
+                           "\"0\":{\"name\":\"main\"},\n"
+                           "\"1\":{\"name\":\"f\",\"parent\":\"0\"},\n"
+                           "\"2\":{\"name\":\"g\",\"parent\":\"1\"},\n"
+                           "\"3\":{\"name\":\"h\",\"parent\":\"1\"},\n"
+                           "\"4\":{\"name\":\"g\",\"parent\":\"0\"}\n}}\n"));
+        free(text);
+    }
+    unlink(path);
+
+    if (failures) {
+        printf("trace_test: %d failed\n", failures);
+        return 1;
+    }
+    printf("trace_test: ok\n");
+    return 0;
+}